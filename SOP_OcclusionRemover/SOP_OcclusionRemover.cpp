@@ -3,15 +3,37 @@
 #include <SOP/SOP_GraphProxy.h>
 #include <OP/OP_Operator.h>
 #include <OP/OP_OperatorTable.h>
+#include <OP/OP_NodeInfoParms.h>
 #include <UT/UT_StringHolder.h>
 #include <PRM/PRM_Include.h>
 #include <PRM/PRM_TemplateBuilder.h>
 #include <UT/UT_DSOVersion.h>
 #include <GA/GA_Handle.h>
 #include <GA/GA_SplittableRange.h>
+#include <GA/GA_PageHandle.h>
 #include <GA/GA_Types.h>
+#include <GA/GA_PolyCounts.h>
+#include <GEO/GEO_PrimPoly.h>
+#include <GOP/GOP_Manager.h>
+#include <GU/GU_Detail.h>
+#include <GU/GU_PrimPacked.h>
+#include <GU/GU_PackedImpl.h>
 #include <SIM/SIM_Random.h>
-#include <tbb/pipeline.h>
+#include <SYS/SYS_AtomicInt.h>
+#include <SYS/SYS_Hash.h>
+#include <UT/UT_UniquePtr.h>
+#include <UT/UT_Map.h>
+#include <UT/UT_Lock.h>
+#include <UT/UT_TaskLock.h>
+#include <UT/UT_StopWatch.h>
+#include <UT/UT_WorkBuffer.h>
+#include <UT/UT_SmallArray.h>
+#include <UT/UT_BitArray.h>
+#include <UT/UT_ParallelUtil.h>
+#include <UT/UT_ThreadSpecificValue.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
 #include <embree3/rtcore.h>
 RTC_NAMESPACE_OPEN
 class PRM_Template;
@@ -41,7 +63,7 @@ protected:
         {
             case 0:     return "Occludee";
             case 1:     return "Occluder";
-            case 2:     return "Visible Area";
+            case 2:     return "Visible Area or Viewpoints";
             default:    return "Invalid Source";
         }
     }
@@ -50,6 +72,7 @@ protected:
     {
         return true;
     }
+    void getNodeSpecificInfoText(OP_Context& context, OP_NodeInfoParms& iparms) override;
 };
 
 using namespace UT::Literal;
@@ -57,6 +80,12 @@ using namespace UT::Literal;
 class SOP_OcclusionRemoverParms : public SOP_NodeParms
 {
 public:
+	static constexpr int kSampleModeTriangle = 0;
+	static constexpr int kSampleModePoint = 1;
+	static constexpr int kMethodHemisphere = 0;
+	static constexpr int kMethodViewpoints = 1;
+	static constexpr int kMethodReverse = 2;
+	static constexpr int kMethodAuto = 3;
     static int version() { return 1; }
     SOP_OcclusionRemoverParms()
     {
@@ -65,7 +94,50 @@ public:
     ~SOP_OcclusionRemoverParms() override {}
     explicit SOP_OcclusionRemoverParms(const SOP_OcclusionRemoverParms&) = default;
     void loadFromOpSubclass(const LoadParms& loadparms) override
-    {}
+	{
+		const SOP_GraphProxy* graph = loadparms.graph();
+		exint nodeidx = loadparms.nodeIdx();
+		fpreal time = loadparms.context().getTime();
+		int64 intValue;
+		fpreal64 floatValue;
+		graph->evalOpParm(myAttrib, nodeidx, "attribname", time, 0);
+		graph->evalOpParm(intValue, nodeidx, "numray", time, 0);
+		numRay = intValue;
+		graph->evalOpParm(intValue, nodeidx, "num_random_sample", time, 0);
+		numRandomSampleForEachPrimitive = intValue;
+		graph->evalOpParm(intValue, nodeidx, "adaptive", time, 0);
+		adaptiveSampling = intValue != 0;
+		graph->evalOpParm(intValue, nodeidx, "maxsamplepoints", time, 0);
+		maxSamplePoints = intValue;
+		graph->evalOpParm(intValue, nodeidx, "samplemode", time, 0);
+		sampleMode = intValue;
+		graph->evalOpParm(intValue, nodeidx, "edgesamples", time, 0);
+		edgeSampleCount = intValue;
+		graph->evalOpParm(pointAttrib, nodeidx, "pointattribname", time, 0);
+		graph->evalOpParm(intValue, nodeidx, "method", time, 0);
+		method = intValue;
+		graph->evalOpParm(intValue, nodeidx, "cuberesolution", time, 0);
+		cubeResolution = intValue;
+		graph->evalOpParm(intValue, nodeidx, "progressive", time, 0);
+		progressive = intValue != 0;
+		graph->evalOpParm(intValue, nodeidx, "numpasses", time, 0);
+		numPasses = intValue;
+		graph->evalOpParm(floatValue, nodeidx, "tolerance", time, 0);
+		tolerance = floatValue;
+		graph->evalOpParm(fractionAttrib, nodeidx, "fractionattribname", time, 0);
+		graph->evalOpParm(rayCountAttrib, nodeidx, "raycountattribname", time, 0);
+		graph->evalOpParm(intValue, nodeidx, "buildquality", time, 0);
+		buildQuality = intValue;
+		graph->evalOpParm(intValue, nodeidx, "compact", time, 0);
+		compactBVH = intValue != 0;
+		graph->evalOpParm(intValue, nodeidx, "raylog", time, 0);
+		rayLog = intValue != 0;
+		graph->evalOpParm(floatValue, nodeidx, "raylogfraction", time, 0);
+		rayLogFraction = floatValue;
+		graph->evalOpParm(rayLogPrims, nodeidx, "raylogprims", time, 0);
+		graph->evalOpParm(intValue, nodeidx, "raylogsize", time, 0);
+		rayLogSize = intValue;
+	}
     void copyFrom(const SOP_NodeParms* src) override
     {
         *this = *((const SOP_OcclusionRemoverParms*)src);
@@ -94,7 +166,58 @@ public:
 			coerceValue(value, numRandomSampleForEachPrimitive);
 			break;
 		case 3:
-			coerceValue(value, parallelism);
+			coerceValue(value, adaptiveSampling);
+			break;
+		case 4:
+			coerceValue(value, maxSamplePoints);
+			break;
+		case 5:
+			coerceValue(value, sampleMode);
+			break;
+		case 6:
+			coerceValue(value, edgeSampleCount);
+			break;
+		case 7:
+			coerceValue(value, pointAttrib);
+			break;
+		case 8:
+			coerceValue(value, method);
+			break;
+		case 9:
+			coerceValue(value, cubeResolution);
+			break;
+		case 10:
+			coerceValue(value, progressive);
+			break;
+		case 11:
+			coerceValue(value, numPasses);
+			break;
+		case 12:
+			coerceValue(value, tolerance);
+			break;
+		case 13:
+			coerceValue(value, fractionAttrib);
+			break;
+		case 14:
+			coerceValue(value, rayCountAttrib);
+			break;
+		case 15:
+			coerceValue(value, buildQuality);
+			break;
+		case 16:
+			coerceValue(value, compactBVH);
+			break;
+		case 17:
+			coerceValue(value, rayLog);
+			break;
+		case 18:
+			coerceValue(value, rayLogFraction);
+			break;
+		case 19:
+			coerceValue(value, rayLogPrims);
+			break;
+		case 20:
+			coerceValue(value, rayLogSize);
 			break;
 		}
 	}
@@ -148,7 +271,7 @@ public:
 	{
 		if (idx.size() == 0)
 		{
-			return 8;
+			return 21;
 		}
 		switch (idx[0])
 		{
@@ -167,13 +290,47 @@ public:
 		switch (fieldnum[0])
 		{
 		case 0:
-			return "attrib";
+			return "attribname";
 		case 1:
 			return "numray";
 		case 2:
-			return "numrandomsample";
+			return "num_random_sample";
 		case 3:
-			return "parallelism";
+			return "adaptive";
+		case 4:
+			return "maxsamplepoints";
+		case 5:
+			return "samplemode";
+		case 6:
+			return "edgesamples";
+		case 7:
+			return "pointattribname";
+		case 8:
+			return "method";
+		case 9:
+			return "cuberesolution";
+		case 10:
+			return "progressive";
+		case 11:
+			return "numpasses";
+		case 12:
+			return "tolerance";
+		case 13:
+			return "fractionattribname";
+		case 14:
+			return "raycountattribname";
+		case 15:
+			return "buildquality";
+		case 16:
+			return "compact";
+		case 17:
+			return "raylog";
+		case 18:
+			return "raylogfraction";
+		case 19:
+			return "raylogprims";
+		case 20:
+			return "raylogsize";
 		}
 		return 0;
 	}
@@ -188,8 +345,43 @@ public:
 			return PARM_STRING;
 		case 1:
 		case 2:
+			return PARM_INTEGER;
 		case 3:
 			return PARM_INTEGER;
+		case 4:
+			return PARM_INTEGER;
+		case 5:
+			return PARM_INTEGER;
+		case 6:
+			return PARM_INTEGER;
+		case 7:
+			return PARM_STRING;
+		case 8:
+			return PARM_INTEGER;
+		case 9:
+			return PARM_INTEGER;
+		case 10:
+			return PARM_INTEGER;
+		case 11:
+			return PARM_INTEGER;
+		case 12:
+			return PARM_FLOAT;
+		case 13:
+			return PARM_STRING;
+		case 14:
+			return PARM_STRING;
+		case 15:
+			return PARM_INTEGER;
+		case 16:
+			return PARM_INTEGER;
+		case 17:
+			return PARM_INTEGER;
+		case 18:
+			return PARM_FLOAT;
+		case 19:
+			return PARM_STRING;
+		case 20:
+			return PARM_INTEGER;
 		}
 		return PARM_UNSUPPORTED;
 	}
@@ -200,21 +392,131 @@ public:
 	void setNumRay(int x) { numRay = x; }
 	int getNumRandomSampleForEachPrimitive() const { return numRandomSampleForEachPrimitive; }
 	void setNumRandomSampleForEachPrimitive(int x) { numRandomSampleForEachPrimitive = x; }
-	int getParallelism() const { return parallelism; }
-	void setParallelism(int value) { parallelism = value; }
+	bool getAdaptiveSampling() const { return adaptiveSampling; }
+	void setAdaptiveSampling(bool x) { adaptiveSampling = x; }
+	int getMaxSamplePoints() const { return maxSamplePoints; }
+	void setMaxSamplePoints(int x) { maxSamplePoints = x; }
+	int getSampleMode() const { return sampleMode; }
+	void setSampleMode(int x) { sampleMode = x; }
+	int getEdgeSampleCount() const { return edgeSampleCount; }
+	void setEdgeSampleCount(int x) { edgeSampleCount = x; }
+	const UT_StringHolder& getPointAttrib() const { return pointAttrib; }
+	void setPointAttrib(const UT_StringHolder& val) { pointAttrib = val; }
+	int getMethod() const { return method; }
+	void setMethod(int x) { method = x; }
+	int getCubeResolution() const { return cubeResolution; }
+	void setCubeResolution(int x) { cubeResolution = x; }
+	bool getProgressive() const { return progressive; }
+	void setProgressive(bool x) { progressive = x; }
+	int getNumPasses() const { return numPasses; }
+	void setNumPasses(int x) { numPasses = x; }
+	float getTolerance() const { return tolerance; }
+	void setTolerance(float x) { tolerance = x; }
+	const UT_StringHolder& getFractionAttrib() const { return fractionAttrib; }
+	void setFractionAttrib(const UT_StringHolder& val) { fractionAttrib = val; }
+	const UT_StringHolder& getRayCountAttrib() const { return rayCountAttrib; }
+	void setRayCountAttrib(const UT_StringHolder& val) { rayCountAttrib = val; }
+	int getBuildQuality() const { return buildQuality; }
+	void setBuildQuality(int x) { buildQuality = x; }
+	bool getCompactBVH() const { return compactBVH; }
+	void setCompactBVH(bool x) { compactBVH = x; }
+	bool getRayLog() const { return rayLog; }
+	void setRayLog(bool x) { rayLog = x; }
+	float getRayLogFraction() const { return rayLogFraction; }
+	void setRayLogFraction(float x) { rayLogFraction = x; }
+	const UT_StringHolder& getRayLogPrims() const { return rayLogPrims; }
+	void setRayLogPrims(const UT_StringHolder& val) { rayLogPrims = val; }
+	int getRayLogSize() const { return rayLogSize; }
+	void setRayLogSize(int x) { rayLogSize = x; }
 private:
 	UT_StringHolder myAttrib = "visibility"_sh;
 	int numRay = 10;
 	int numRandomSampleForEachPrimitive = 10;
-	int parallelism = 4;
+	bool adaptiveSampling = false;
+	int maxSamplePoints = 64;
+	int sampleMode = 0;
+	int edgeSampleCount = 1;
+	UT_StringHolder pointAttrib = "point_visibility"_sh;
+	int method = 0;
+	int cubeResolution = 256;
+	bool progressive = false;
+	int numPasses = 3;
+	float tolerance = 0.05f;
+	UT_StringHolder fractionAttrib = "visible_fraction"_sh;
+	UT_StringHolder rayCountAttrib = "ray_count"_sh;
+	int buildQuality = 1;
+	bool compactBVH = false;
+	bool rayLog = false;
+	float rayLogFraction = 0.01f;
+	UT_StringHolder rayLogPrims = ""_sh;
+	int rayLogSize = 10000;
 };
 
 struct RayHit
 {
 	bool isVisible;
+	bool isOccluded;
 	int hitPrim;
 	float hitU, hitV;
+	// ray parameter of the hit, only set by QueryRayHit8
+	float hitDistance;
+	// index of the packed instance of the occluder that was hit, or -1, only set by QueryRayHit8
+	int hitInstance;
 	UT_Vector3 hitPos;
+	// unnormalized geometric normal of the hit triangle, as embree orients it: opposite to the houdini normal
+	UT_Vector3 hitNormal;
+};
+
+/// <summary>
+/// build settings of a scene, chosen per node to trade build time and memory for trace time.
+/// </summary>
+struct SceneBuildSettings
+{
+	static constexpr int kQualityLow = 0;
+	static constexpr int kQualityMedium = 1;
+	static constexpr int kQualityHigh = 2;
+	int quality = kQualityMedium;
+	bool compact = false;
+	bool operator == (const SceneBuildSettings& rhs) const
+	{
+		return quality == rhs.quality && compact == rhs.compact;
+	}
+	RTCBuildQuality GetSceneQuality() const
+	{
+		switch (quality)
+		{
+		case kQualityLow:
+			return RTC_BUILD_QUALITY_LOW;
+		case kQualityHigh:
+			return RTC_BUILD_QUALITY_HIGH;
+		default:
+			return RTC_BUILD_QUALITY_MEDIUM;
+		}
+	}
+	/// <summary>
+	/// quality of the flat meshes. they're built for refit unless high quality is asked,
+	/// a refit BVH degrades as the points move, so high quality rebuilds them instead.
+	/// </summary>
+	RTCBuildQuality GetGeometryQuality() const
+	{
+		return quality == kQualityHigh ? RTC_BUILD_QUALITY_HIGH : RTC_BUILD_QUALITY_REFIT;
+	}
+	RTCSceneFlags GetSceneFlags() const
+	{
+		return compact ? RTCSceneFlags(RTC_SCENE_FLAG_ROBUST | RTC_SCENE_FLAG_COMPACT) : RTC_SCENE_FLAG_ROBUST;
+	}
+	const char* GetQualityName() const
+	{
+		switch (quality)
+		{
+		case kQualityLow:
+			return "low";
+		case kQualityHigh:
+			return "high";
+		default:
+			return "medium";
+		}
+	}
 };
 
 class RayTracingAccelerationStructure
@@ -227,9 +529,37 @@ private:
 	UT_Array<uint> _occluderIndices;
 	UT_Array<float> _visibleAreaVertices;
 	UT_Array<uint> _visibleAreaIndices;
+	// first triangle of every primitive, plus the total, to map a hit triangle back to its primitive
+	UT_Array<exint> _occluderTriangleStart;
+	UT_Array<exint> _visibleAreaTriangleStart;
+	/// <summary>
+	/// a unique packed mesh of the occluder, built once as its own scene and referenced by every instance of it.
+	/// </summary>
+	struct InstancePrototype
+	{
+		RTCScene scene;
+		RTCGeometry geometry;
+		UT_Array<float> vertices;
+		UT_Array<uint> indices;
+		UT_Array<exint> triangleStart;
+	};
+	// prototypes are held by pointer, their buffers are shared with embree and must not move
+	UT_Array<UT_UniquePtr<InstancePrototype>> _prototypes;
+	UT_Array<RTCGeometry> _instances;
+	// the packed primitive of every instance, to update its transform
+	UT_Array<GA_Offset> _instancePrims;
+	// and its index, to map a hit back to it
+	UT_Array<GA_Index> _instancePrimIndices;
 	const int kOccluderId = 1;
 	const int kVisibleAreaId = 2;
+	const int kFirstInstanceId = 3;
+	const uint kOccluderMask = 0x1;
+	const uint kVisibleAreaMask = 0x2;
 	bool _initialized = false;
+	bool _maskSupported = false;
+	SceneBuildSettings _settings;
+	// seconds spent in the last build or refit
+	fpreal _buildTime = 0;
 public:
 	UT_Array<float>* GetOccluderVerticesRef()
 	{
@@ -251,16 +581,20 @@ public:
 		if (!_initialized) return nullptr;
 		return &_visibleAreaIndices;
 	}
-	void Initialize(RTCDevice& pDevice, const GA_Detail& occluder, const GA_Detail& visibleArea)
+	void Initialize(RTCDevice& pDevice, const GA_Detail& occluder, const GA_Detail& visibleArea, const SceneBuildSettings& settings)
 	{
 		if (_initialized)
 		{
 			Destroy();
 		}
+		UT_StopWatch timer;
+		timer.start();
+		_settings = settings;
 		_scene = rtcNewScene(pDevice);
-		rtcSetSceneFlags(_scene, RTC_SCENE_FLAG_ROBUST);
-		FillMeshBuffer(_occluderVertices, _occluderIndices, occluder);
-		FillMeshBuffer(_visibleAreaVertices, _visibleAreaIndices, visibleArea);
+		rtcSetSceneFlags(_scene, settings.GetSceneFlags());
+		rtcSetSceneBuildQuality(_scene, settings.GetSceneQuality());
+		FillMeshBuffer(_occluderVertices, _occluderIndices, _occluderTriangleStart, occluder);
+		FillMeshBuffer(_visibleAreaVertices, _visibleAreaIndices, _visibleAreaTriangleStart, visibleArea);
 		_occluder = rtcNewGeometry(pDevice, RTC_GEOMETRY_TYPE_TRIANGLE);
 		_visibleArea = rtcNewGeometry(pDevice, RTC_GEOMETRY_TYPE_TRIANGLE);
 		rtcSetSharedGeometryBuffer(
@@ -269,7 +603,7 @@ public:
 			0,
 			RTC_FORMAT_FLOAT3,
 			_occluderVertices.data(),
-			0, sizeof(float) * 3, _occluderVertices.size()
+			0, sizeof(float) * 3, _occluderVertices.size() / 3
 		);
 		rtcSetSharedGeometryBuffer(
 			_occluder,
@@ -285,7 +619,7 @@ public:
 			0,
 			RTC_FORMAT_FLOAT3,
 			_visibleAreaVertices.data(),
-			0, sizeof(float) * 3, _visibleAreaVertices.size());
+			0, sizeof(float) * 3, _visibleAreaVertices.size() / 3);
 		rtcSetSharedGeometryBuffer(
 			_visibleArea,
 			RTC_BUFFER_TYPE_INDEX,
@@ -294,12 +628,108 @@ public:
 			_visibleAreaIndices.data(),
 			0, sizeof(uint) * 3, _visibleAreaIndices.size() / 3
 		);
+		// refit quality lets UpdatePositions refit the BVH of animated geometry instead of rebuilding it
+		rtcSetGeometryBuildQuality(_occluder, settings.GetGeometryQuality());
+		rtcSetGeometryBuildQuality(_visibleArea, settings.GetGeometryQuality());
+		// masks let QueryVisibility8 trace the two geometries separately.
+		// they're ignored by an embree built without ray mask support, which is checked here.
+		_maskSupported = rtcGetDeviceProperty(pDevice, RTC_DEVICE_PROPERTY_RAY_MASK_SUPPORTED) != 0;
+		rtcSetGeometryMask(_occluder, kOccluderMask);
+		rtcSetGeometryMask(_visibleArea, kVisibleAreaMask);
 		rtcCommitGeometry(_occluder);
 		rtcCommitGeometry(_visibleArea);
 		rtcAttachGeometryByID(_scene, _occluder, kOccluderId);
 		rtcAttachGeometryByID(_scene, _visibleArea, kVisibleAreaId);
+		AttachPackedInstances(pDevice, occluder);
 		rtcCommitScene(_scene);
 		_initialized = true;
+		_buildTime = timer.stop();
+	}
+	/// <summary>
+	/// reference the packed primitives of the occluder as embree instances.
+	/// the flat occluder mesh skips them, they have less than 3 vertices.
+	/// packed primitives sharing their packed detail share one prototype scene, so a set dressed occluder
+	/// costs one mesh per unique asset plus one transform per copy, instead of being unpacked upstream.
+	/// </summary>
+	void AttachPackedInstances(RTCDevice& pDevice, const GA_Detail& occluder)
+	{
+		UT_Map<exint, int> prototypeIndices;
+		GA_Offset primOff;
+		GA_FOR_ALL_PRIMOFF(&occluder, primOff)
+		{
+			const GU_PrimPacked* packed = dynamic_cast<const GU_PrimPacked*>(occluder.getPrimitive(primOff));
+			if (packed == nullptr)
+			{
+				continue;
+			}
+			GU_ConstDetailHandle packedDetail = packed->implementation()->getPackedDetail();
+			const GU_Detail* packedGeom = packedDetail.gdp();
+			if (packedGeom == nullptr || packedGeom->getNumPrimitives() == 0)
+			{
+				continue;
+			}
+			int prototypeIndex;
+			auto it = prototypeIndices.find(packedGeom->getUniqueId());
+			if (it != prototypeIndices.end())
+			{
+				prototypeIndex = it->second;
+			}
+			else
+			{
+				prototypeIndex = _prototypes.size();
+				prototypeIndices[packedGeom->getUniqueId()] = prototypeIndex;
+				_prototypes.append(UTmakeUnique<InstancePrototype>());
+				BuildPrototype(pDevice, *_prototypes.last(), *packedGeom);
+			}
+			RTCGeometry instance = rtcNewGeometry(pDevice, RTC_GEOMETRY_TYPE_INSTANCE);
+			rtcSetGeometryInstancedScene(instance, _prototypes[prototypeIndex]->scene);
+			rtcSetGeometryTimeStepCount(instance, 1);
+			SetInstanceTransform(instance, *packed);
+			rtcSetGeometryMask(instance, kOccluderMask);
+			rtcCommitGeometry(instance);
+			rtcAttachGeometryByID(_scene, instance, kFirstInstanceId + _instances.size());
+			_instances.append(instance);
+			_instancePrims.append(primOff);
+			_instancePrimIndices.append(occluder.primitiveIndex(primOff));
+		}
+	}
+	void BuildPrototype(RTCDevice& pDevice, InstancePrototype& prototype, const GA_Detail& geom)
+	{
+		prototype.scene = rtcNewScene(pDevice);
+		rtcSetSceneFlags(prototype.scene, _settings.GetSceneFlags());
+		rtcSetSceneBuildQuality(prototype.scene, _settings.GetSceneQuality());
+		FillMeshBuffer(prototype.vertices, prototype.indices, prototype.triangleStart, geom);
+		prototype.geometry = rtcNewGeometry(pDevice, RTC_GEOMETRY_TYPE_TRIANGLE);
+		rtcSetSharedGeometryBuffer(
+			prototype.geometry,
+			RTC_BUFFER_TYPE_VERTEX,
+			0,
+			RTC_FORMAT_FLOAT3,
+			prototype.vertices.data(),
+			0, sizeof(float) * 3, prototype.vertices.size() / 3
+		);
+		rtcSetSharedGeometryBuffer(
+			prototype.geometry,
+			RTC_BUFFER_TYPE_INDEX,
+			0,
+			RTC_FORMAT_UINT3,
+			prototype.indices.data(),
+			0, sizeof(uint) * 3, prototype.indices.size() / 3
+		);
+		// masks are tested at the instance and again inside the prototype scene
+		rtcSetGeometryMask(prototype.geometry, kOccluderMask);
+		rtcCommitGeometry(prototype.geometry);
+		rtcAttachGeometry(prototype.scene, prototype.geometry);
+		rtcCommitScene(prototype.scene);
+	}
+	static void SetInstanceTransform(RTCGeometry instance, const GU_PrimPacked& packed)
+	{
+		UT_Matrix4D xform;
+		packed.getFullTransform4(xform);
+		// houdini matrices are row major and transform row vectors,
+		// so the same 16 floats read column major are the column vector matrix embree expects
+		UT_Matrix4F xformF(xform);
+		rtcSetGeometryTransform(instance, 0, RTC_FORMAT_FLOAT4X4_COLUMN_MAJOR, xformF.data());
 	}
 	void Destroy()
 	{
@@ -309,55 +739,150 @@ public:
 		_visibleAreaIndices.clear();
 		rtcReleaseGeometry(_occluder);
 		rtcReleaseGeometry(_visibleArea);
+		for (int i = 0; i < _instances.size(); ++i)
+		{
+			rtcReleaseGeometry(_instances[i]);
+		}
+		_instances.clear();
+		_instancePrims.clear();
+		_instancePrimIndices.clear();
+		for (int i = 0; i < _prototypes.size(); ++i)
+		{
+			rtcReleaseGeometry(_prototypes[i]->geometry);
+			rtcReleaseScene(_prototypes[i]->scene);
+		}
+		_prototypes.clear();
 		rtcReleaseScene(_scene);
 	}
 	bool IsInitialized()
 	{
 		return _initialized;
 	}
-	void FillMeshBuffer(UT_Array<float>& vertices, UT_Array<uint>& indices, const GA_Detail& geom)
+	const SceneBuildSettings& GetBuildSettings() const
 	{
-		UT_Array<int> primIndicesBuffer;
-		for (int primId = 0; primId < geom.getNumPrimitives(); ++primId)
+		return _settings;
+	}
+	fpreal GetBuildTime() const
+	{
+		return _buildTime;
+	}
+	/// <summary>
+	/// bytes of the mesh buffers shared with embree.
+	/// </summary>
+	int64 GetBufferMemoryUsage() const
+	{
+		int64 bytes = _occluderVertices.getMemoryUsage() + _occluderIndices.getMemoryUsage()
+			+ _visibleAreaVertices.getMemoryUsage() + _visibleAreaIndices.getMemoryUsage();
+		for (int i = 0; i < _prototypes.size(); ++i)
 		{
-			primIndicesBuffer.clear();
-			auto prim = geom.getPrimitiveByIndex(primId);
-			prim->forEachPoint(
-				[&](int pid)
+			bytes += _prototypes[i]->vertices.getMemoryUsage() + _prototypes[i]->indices.getMemoryUsage();
+		}
+		return bytes;
+	}
+	/// <summary>
+	/// fan triangulate every primitive of geom into indices and copy its points into vertices.
+	/// the triangles are counted per primitive and prefix summed first, so both passes run in parallel into pre-sized buffers.
+	/// </summary>
+	void FillMeshBuffer(UT_Array<float>& vertices, UT_Array<uint>& indices, UT_Array<exint>& triangleStart, const GA_Detail& geom)
+	{
+		const GA_Size numPrim = geom.getNumPrimitives();
+		triangleStart.setSizeNoInit(numPrim + 1);
+		UTparallelForLightItems(UT_BlockedRange<GA_Size>(0, numPrim), [&geom, &triangleStart](const UT_BlockedRange<GA_Size>& r)
+			{
+				for (GA_Size primId = r.begin(); primId != r.end(); ++primId)
 				{
-					primIndicesBuffer.append(pid);
-				});
-			if (primIndicesBuffer.size() == 3)
+					GA_Size numVertex = geom.getPrimitiveVertexCount(geom.primitiveOffset(primId));
+					triangleStart[primId] = numVertex >= 3 ? numVertex - 2 : 0;
+				}
+			});
+		exint numTriangle = 0;
+		for (GA_Size primId = 0; primId < numPrim; ++primId)
+		{
+			exint count = triangleStart[primId];
+			triangleStart[primId] = numTriangle;
+			numTriangle += count;
+		}
+		triangleStart[numPrim] = numTriangle;
+
+		indices.setSizeNoInit(numTriangle * 3);
+		UTparallelForLightItems(UT_BlockedRange<GA_Size>(0, numPrim), [&geom, &triangleStart, &indices](const UT_BlockedRange<GA_Size>& r)
 			{
-				for (int i = 0; i < 3; ++i)
+				for (GA_Size primId = r.begin(); primId != r.end(); ++primId)
 				{
-					indices.append(primIndicesBuffer[i]);
+					GA_Offset primOff = geom.primitiveOffset(primId);
+					exint index = triangleStart[primId] * 3;
+					exint numTriangle = triangleStart[primId + 1] - triangleStart[primId];
+					if (numTriangle == 0)
+					{
+						continue;
+					}
+					uint a = geom.pointIndex(geom.vertexPoint(geom.getPrimitiveVertexOffset(primOff, 0)));
+					uint b = geom.pointIndex(geom.vertexPoint(geom.getPrimitiveVertexOffset(primOff, 1)));
+					for (exint i = 0; i < numTriangle; ++i)
+					{
+						uint c = geom.pointIndex(geom.vertexPoint(geom.getPrimitiveVertexOffset(primOff, i + 2)));
+						indices[index++] = a;
+						indices[index++] = b;
+						indices[index++] = c;
+						b = c;
+					}
 				}
-			}
-			else if (primIndicesBuffer.size() > 3)
+			});
+		FillVertexBuffer(vertices, geom);
+	}
+	/// <summary>
+	/// copy the point positions of geom into vertices.
+	/// a buffer that already has the right size is overwritten in place, so it stays valid as a shared embree buffer.
+	/// </summary>
+	void FillVertexBuffer(UT_Array<float>& vertices, const GA_Detail& geom)
+	{
+		vertices.setSizeNoInit(geom.getNumPoints() * 3);
+		UTparallelForLightItems(GA_SplittableRange(geom.getPointRange()), [&geom, &vertices](const GA_SplittableRange& r)
 			{
-				int a = primIndicesBuffer[0];
-				int b = primIndicesBuffer[1];
-				for (int i = 2; i < primIndicesBuffer.size(); ++i)
+				GA_ROPageHandleV3 P_ph(geom.getP());
+				GA_Offset start, end;
+				for (GA_Iterator it(r); it.blockAdvance(start, end);)
 				{
-					indices.append(a);
-					indices.append(b);
-					indices.append(primIndicesBuffer[i]);
-					b = primIndicesBuffer[i];
+					P_ph.setPage(start);
+					// offsets of a block are contiguous, so are their indices
+					float* dst = vertices.data() + geom.pointIndex(start) * 3;
+					for (GA_Offset ptOff = start; ptOff < end; ++ptOff)
+					{
+						UT_Vector3 P = P_ph.get(ptOff);
+						*dst++ = P.x();
+						*dst++ = P.y();
+						*dst++ = P.z();
+					}
 				}
-			}
-		}
-		GA_Offset rangeBegin, rangeEnd;
-		for (GA_Iterator it(geom.getPointRange()); it.blockAdvance(rangeBegin, rangeEnd);)
+			});
+	}
+	/// <summary>
+	/// update the vertex buffers of an initialized scene when only the point positions changed,
+	/// and refit the BVH instead of rebuilding it.
+	/// the topology of both details must be the one the scene was initialized with.
+	/// </summary>
+	void UpdatePositions(const GA_Detail& occluder, const GA_Detail& visibleArea)
+	{
+		UT_ASSERT(_initialized);
+		UT_StopWatch timer;
+		timer.start();
+		UT_ASSERT(_occluderVertices.size() == occluder.getNumPoints() * 3);
+		UT_ASSERT(_visibleAreaVertices.size() == visibleArea.getNumPoints() * 3);
+		FillVertexBuffer(_occluderVertices, occluder);
+		FillVertexBuffer(_visibleAreaVertices, visibleArea);
+		rtcUpdateGeometryBuffer(_occluder, RTC_BUFFER_TYPE_VERTEX, 0);
+		rtcUpdateGeometryBuffer(_visibleArea, RTC_BUFFER_TYPE_VERTEX, 0);
+		rtcCommitGeometry(_occluder);
+		rtcCommitGeometry(_visibleArea);
+		// packed primitives are placed by their point, so their transforms follow P
+		for (int i = 0; i < _instances.size(); ++i)
 		{
-			for (auto ptOff = rangeBegin; ptOff < rangeEnd; ++ptOff)
-			{
-				auto P = geom.getPos3(ptOff);
-				vertices.append(P.x());
-				vertices.append(P.y());
-				vertices.append(P.z());
-			}
+			const GU_PrimPacked* packed = static_cast<const GU_PrimPacked*>(occluder.getPrimitive(_instancePrims[i]));
+			SetInstanceTransform(_instances[i], *packed);
+			rtcCommitGeometry(_instances[i]);
 		}
+		rtcCommitScene(_scene);
+		_buildTime = timer.stop();
 	}
 	
 	void QueryRayHit(float ox, float oy, float oz, float dx, float dy, float dz, float near, float far, RayHit* pHit)
@@ -383,188 +908,183 @@ public:
 		rtcIntersect1(_scene, &context, &hit);
 		if (hit.hit.geomID != RTC_INVALID_GEOMETRY_ID)
 		{
-			pHit->isVisible = hit.hit.geomID == kVisibleAreaId;
+			// a hit in an instance reports the geometry of the prototype scene, only the flat visible area is visible
+			pHit->isVisible = hit.hit.instID[0] == RTC_INVALID_GEOMETRY_ID && hit.hit.geomID == kVisibleAreaId;
+			pHit->isOccluded = !pHit->isVisible;
 		}
 		else
 		{
 			pHit->isVisible = false;
+			pHit->isOccluded = false;
 		}
 		pHit->hitPrim = hit.hit.primID;
 		pHit->hitU = hit.hit.u;
 		pHit->hitV = hit.hit.v;
 		pHit->hitPos = UT_Vector3(ox, oy, oz) + hit.ray.tfar * UT_Vector3(dx, dy, dz);
 	}
-};
-
-class SOP_OcclusionRemoverCache : public SOP_NodeCache
-{
-private:
-	RTCDevice _device;
-	RayTracingAccelerationStructure _as;
 
-	struct CacheVersionKey
-	{
-		bool valid = false;
-		GA_DataId topologyDataId;
-		GA_DataId primListDataId;
-		GA_DataId PDataId;
-		CacheVersionKey() {}
-		CacheVersionKey(GA_DataId topologyId, GA_DataId primId, GA_DataId pId)
-			: topologyDataId(topologyId), primListDataId(primId), PDataId(pId)
-		{}
-		bool operator == (const CacheVersionKey& rhs) const
-		{
-			return topologyDataId == rhs.topologyDataId
-				&& primListDataId == rhs.primListDataId
-				&& PDataId == rhs.PDataId;
-		}
-	} _occluderCacheKey, _visibleAreaCacheKey;
-public:
-    SOP_OcclusionRemoverCache() : SOP_NodeCache()
-    {
-		_device = rtcNewDevice(nullptr);
-	}
-    virtual ~SOP_OcclusionRemoverCache() 
-	{
-		if (_as.IsInitialized())
+	/// <summary>
+	/// trace up to 8 rays as one packet with rtcIntersect8.
+	/// ox..dz are arrays of numRay values, and pHits receives numRay results.
+	/// rays in a packet are expected to be coherent (e.g. share an origin).
+	/// pNears, if not nullptr, holds the near distance of every ray in place of near.
+	/// </summary>
+	void QueryRayHit8(int numRay,
+		const float* ox, const float* oy, const float* oz,
+		const float* dx, const float* dy, const float* dz,
+		float near, float far, RayHit* pHits, const float* pNears = nullptr)
+	{
+		UT_ASSERT(numRay > 0 && numRay <= 8);
+		alignas(32) int valid[8];
+		alignas(32) RTCRayHit8 hit;
+		for (int i = 0; i < 8; ++i)
 		{
-			_as.Destroy();
+			bool active = i < numRay;
+			int src = active ? i : 0;
+			valid[i] = active ? -1 : 0;
+			hit.ray.org_x[i] = ox[src];
+			hit.ray.org_y[i] = oy[src];
+			hit.ray.org_z[i] = oz[src];
+			hit.ray.dir_x[i] = dx[src];
+			hit.ray.dir_y[i] = dy[src];
+			hit.ray.dir_z[i] = dz[src];
+			hit.ray.tnear[i] = pNears != nullptr ? pNears[src] : near;
+			hit.ray.tfar[i] = far;
+			hit.ray.time[i] = 0;
+			hit.ray.mask[i] = -1;
+			hit.ray.id[i] = i;
+			hit.ray.flags[i] = 0;
+			hit.hit.geomID[i] = RTC_INVALID_GEOMETRY_ID;
+			hit.hit.primID[i] = RTC_INVALID_GEOMETRY_ID;
+			hit.hit.instID[0][i] = RTC_INVALID_GEOMETRY_ID;
 		}
-		rtcReleaseDevice(_device);
-	}
-	
-	void EnsureCache(const GA_Detail& occluder, const GA_Detail& visibleArea)
-	{
-		CacheVersionKey occluderCacheKey = CacheVersionKey(
-			occluder.getTopology().getDataId(),
-			occluder.getPrimitiveList().getDataId(),
-			occluder.getP()->getDataId());
-		CacheVersionKey visibleAreaCacheKey = CacheVersionKey(
-			visibleArea.getTopology().getDataId(),
-			visibleArea.getPrimitiveList().getDataId(),
-			visibleArea.getP()->getDataId());
-		if (occluderCacheKey == _occluderCacheKey && visibleAreaCacheKey == _visibleAreaCacheKey)
+
+		RTCIntersectContext context;
+		rtcInitIntersectContext(&context);
+		context.flags = RTC_INTERSECT_CONTEXT_FLAG_COHERENT;
+		rtcIntersect8(valid, _scene, &context, &hit);
+		for (int i = 0; i < numRay; ++i)
 		{
-			return;
+			RayHit* pHit = &pHits[i];
+			bool isHit = hit.hit.geomID[i] != RTC_INVALID_GEOMETRY_ID;
+			pHit->isVisible = isHit && hit.hit.instID[0][i] == RTC_INVALID_GEOMETRY_ID && hit.hit.geomID[i] == kVisibleAreaId;
+			pHit->isOccluded = isHit && !pHit->isVisible;
+			pHit->hitPrim = hit.hit.primID[i];
+			pHit->hitU = hit.hit.u[i];
+			pHit->hitV = hit.hit.v[i];
+			pHit->hitDistance = hit.ray.tfar[i];
+			pHit->hitInstance = hit.hit.instID[0][i] != RTC_INVALID_GEOMETRY_ID ? int(hit.hit.instID[0][i]) - kFirstInstanceId : -1;
+			pHit->hitPos = UT_Vector3(ox[i], oy[i], oz[i]) + hit.ray.tfar[i] * UT_Vector3(dx[i], dy[i], dz[i]);
+			pHit->hitNormal = UT_Vector3(hit.hit.Ng_x[i], hit.hit.Ng_y[i], hit.hit.Ng_z[i]);
 		}
-		_occluderCacheKey = occluderCacheKey;
-		_visibleAreaCacheKey = visibleAreaCacheKey;
-		_as.Initialize(_device, occluder, visibleArea);
-	}
-
-	RayTracingAccelerationStructure& GetRayTracingAccelerationStructureRef()
-	{
-		return _as;
 	}
 
 	/// <summary>
-	/// return pointer to cached occluder vertices buffer.
-	/// return nullptr if cache is not prepared.
+	/// index of the visible area primitive the triangle primID was built from.
 	/// </summary>
-	/// <returns></returns>
-	UT_Array<float>* GetOccluderVerticesRef()
+	int GetVisibleAreaPrim(uint primID) const
 	{
-		return _as.GetOccluderVerticesRef();
+		auto it = std::upper_bound(_visibleAreaTriangleStart.begin(), _visibleAreaTriangleStart.end(), exint(primID));
+		return int(it - _visibleAreaTriangleStart.begin()) - 1;
 	}
 	/// <summary>
-	/// return pointer to cached occluder indices buffer.
-	/// return nullptr if cache is not prepared.
+	/// index of the occluder primitive hit by a ray of QueryRayHit8: the packed primitive of an instance hit,
+	/// or the primitive the hit triangle of the flat mesh was built from.
 	/// </summary>
-	/// <returns></returns>
-	UT_Array<uint>* GetOccluderIndicesRef()
+	int GetOccluderPrim(const RayHit& hit) const
 	{
-		return _as.GetOccluderIndicesRef();
+		if (hit.hitInstance >= 0)
+		{
+			return int(_instancePrimIndices[hit.hitInstance]);
+		}
+		auto it = std::upper_bound(_occluderTriangleStart.begin(), _occluderTriangleStart.end(), exint(hit.hitPrim));
+		return int(it - _occluderTriangleStart.begin()) - 1;
 	}
 	/// <summary>
-	/// return pointer to cached visible area vertices buffer.
-	/// return nullptr if cache is not prepared.
+	/// return true if QueryVisibility8 can be used, i.e. embree supports ray masks.
 	/// </summary>
-	/// <returns></returns>
-	UT_Array<float>* GetVisibleAreaVerticesRef()
+	bool SupportsVisibilityQuery() const
 	{
-		return _as.GetVisibleAreaVerticesRef();
+		return _maskSupported;
 	}
 	/// <summary>
-	/// return pointer to cached visible area indices buffer.
-	/// return nullptr if cache is not prepared.
+	/// occlusion only version of QueryRayHit8, which only fills isVisible and isOccluded of pHits.
+	/// the closest hit on the visible area is found first, with the occluder masked out,
+	/// then an occlusion query against the occluder alone tells whether anything blocks the ray before that hit.
+	/// the occlusion query stops at the first occluder hit, and no hit data is computed for it.
 	/// </summary>
-	/// <returns></returns>
-	UT_Array<uint>* GetVisibleAreaIndicesRef()
-	{
-		return _as.GetVisibleAreaIndicesRef();
-	}
-};
+	void QueryVisibility8(int numRay,
+		const float* ox, const float* oy, const float* oz,
+		const float* dx, const float* dy, const float* dz,
+		float near, float far, RayHit* pHits)
+	{
+		UT_ASSERT(numRay > 0 && numRay <= 8);
+		UT_ASSERT(_maskSupported);
+		alignas(32) int valid[8];
+		alignas(32) RTCRayHit8 hit;
+		for (int i = 0; i < 8; ++i)
+		{
+			bool active = i < numRay;
+			int src = active ? i : 0;
+			valid[i] = active ? -1 : 0;
+			hit.ray.org_x[i] = ox[src];
+			hit.ray.org_y[i] = oy[src];
+			hit.ray.org_z[i] = oz[src];
+			hit.ray.dir_x[i] = dx[src];
+			hit.ray.dir_y[i] = dy[src];
+			hit.ray.dir_z[i] = dz[src];
+			hit.ray.tnear[i] = near;
+			hit.ray.tfar[i] = far;
+			hit.ray.time[i] = 0;
+			hit.ray.mask[i] = kVisibleAreaMask;
+			hit.ray.id[i] = i;
+			hit.ray.flags[i] = 0;
+			hit.hit.geomID[i] = RTC_INVALID_GEOMETRY_ID;
+			hit.hit.primID[i] = RTC_INVALID_GEOMETRY_ID;
+			hit.hit.instID[0][i] = RTC_INVALID_GEOMETRY_ID;
+		}
 
-struct Ray
-{
-	int primId;
-	float ox, oy, oz;
-	float dx, dy, dz;
-	bool visible;
-	int hitPrim;
-	float hitU, hitV;
-	UT_Vector3 hitPos;
-public:
-	static Ray* Allocate()
-	{
-		Ray* ray = (Ray*)tbb::tbb_allocator<char>().allocate(sizeof(Ray));
-		return ray;
-	}
-	void Free()
-	{
-		tbb::tbb_allocator<char>().deallocate((char*)this, sizeof(Ray));
-	}
-	void SetRayOrigin(float x, float y, float z)
-	{
-		ox = x;
-		oy = y;
-		oz = z;
-	}
-	void SetRayDirection(float x, float y, float z)
-	{
-		dx = x;
-		dy = y;
-		dz = z;
+		RTCIntersectContext context;
+		rtcInitIntersectContext(&context);
+		context.flags = RTC_INTERSECT_CONTEXT_FLAG_COHERENT;
+		rtcIntersect8(valid, _scene, &context, &hit);
+
+		// the visible area hit, if any, bounds the occlusion ray, tfar is left at far by a miss
+		alignas(32) RTCRay8 shadow = hit.ray;
+		for (int i = 0; i < 8; ++i)
+		{
+			shadow.mask[i] = kOccluderMask;
+		}
+		rtcOccluded8(valid, _scene, &context, &shadow);
+		for (int i = 0; i < numRay; ++i)
+		{
+			RayHit* pHit = &pHits[i];
+			// rtcOccluded8 sets tfar to -inf for the rays it found blocked
+			bool blocked = shadow.tfar[i] < 0;
+			pHit->isOccluded = blocked;
+			pHit->isVisible = !blocked && hit.hit.geomID[i] != RTC_INVALID_GEOMETRY_ID;
+			pHit->hitPrim = -1;
+		}
 	}
 };
 
-const float epsilon = 1e-6;
-class RayGeneratorCache
+/// <summary>
+/// the primitive independent part of the sample rays: the unit hemisphere directions of a sample point
+/// and the barycentric coordinates of the random sample points.
+/// they only depend on the ray counts, so they're built once and kept in the node cache.
+/// </summary>
+class RaySampleTables
 {
 private:
-	const GEO_Detail* _pGeom;
-	bool _initialized = false;
-	int _primNum;
-	UT_Array<int> _primIndicesBuffer;
-	GA_ROHandleV3 _primNormalAttr;
-
-	UT_Array<Ray*> _rays;
-	int _currentCursor = 0;
-	int _currentPrim = 0;
-	int _numRay;
-	int _numRandomSampleCount;
+	int _numRay = -1;
+	int _numBarycentric = -1;
+	// unit hemisphere directions around +y, as structure of arrays so the rotation into a frame vectorises
+	UT_Array<float> _directionX;
+	UT_Array<float> _directionY;
+	UT_Array<float> _directionZ;
+	UT_Array<UT_Vector3> _barycentrics;
 public:
-	void Initialize(const GEO_Detail& geom, int numRay, int numRandomSampleCount)
-	{
-		_currentPrim = 0;
-		_pGeom = &geom;
-		_primNum = geom.getNumPrimitives();
-		_initialized = true;
-		_numRay = numRay;
-		_numRandomSampleCount = numRandomSampleCount;
-		_primNormalAttr = GA_ROHandleV3(geom.findFloatTuple(GA_ATTRIB_PRIMITIVE, "Normal"));
-	}
-	bool IsInitialized()
-	{
-		return _initialized;
-	}
-	void ClearRayBuffer()
-	{
-		_rays.clear();
-		_currentCursor = 0;
-	}
-
-	double RadicalInverse(int base, int i)
+	static double RadicalInverse(int base, int i)
 	{
 		int pointCoef = 1;
 		int inverse = 0;
@@ -575,9 +1095,9 @@ public:
 		}
 		return inverse / (double)pointCoef;
 	}
-	double Hammersley(int dimension, int index, int numSamples)
+	static double Hammersley(int dimension, int index, int numSamples)
 	{
-		static double primTable[] = { 2, 3, 5 };
+		static const int primTable[] = { 2, 3, 5 };
 		if (dimension == 0)
 		{
 			return index / (double)numSamples;
@@ -588,7 +1108,7 @@ public:
 			return RadicalInverse(primTable[dimension - 1], index);
 		}
 	}
-	uint32_t InverseBase4(uint32_t value)
+	static uint32_t InverseBase4(uint32_t value)
 	{
 		value = ((value & 0xFFFF0000) >> 16) | ((value & 0x0000FFFF) << 16);
 		value = ((value & 0xFF00FF00) >> 8) | ((value & 0x00FF00FF) << 8);
@@ -601,7 +1121,7 @@ public:
 	/// code adapt from:
 	/// https://pharr.org/matt/blog/2019/02/27/triangle-sampling-1
 	/// </summary>
-	UT_Vector3 BasuOwenMapping(uint32_t value)
+	static UT_Vector3 BasuOwenMapping(uint32_t value)
 	{
 		UT_Vector2 A, B, C, An, Bn, Cn;
 		A = UT_Vector2(1, 0);
@@ -640,261 +1160,1814 @@ public:
 		UT_Vector2 r2 = (A + B + C) / 3;
 		return UT_Vector3(r2.x(), r2.y(), 1 - r2.x() - r2.y());
 	}
-	UT_Vector3 Transform(const UT_Matrix4& mat, const UT_Vector3& pos)
-	{
-		auto raw = mat.data();
-		auto x = raw[0] * pos[0] + raw[1] * pos[1] + raw[2] * pos[2] + raw[3] * 1;
-		auto y = raw[4] * pos[0] + raw[5] * pos[1] + raw[6] * pos[2] + raw[7] * 1;
-		auto z = raw[8] * pos[0] + raw[9] * pos[1] + raw[10] * pos[2] + raw[11] * 1;
-		auto w = raw[12] * pos[0] + raw[13] * pos[1] + raw[14] * pos[2] + raw[15] * 1;
-		UT_Vector3 result = UT_Vector3(x / w, y / w, z / w);
-		return result;
-	}
-	void GenerateHemisphereRays(UT_Vector3 pos, UT_Vector3 normal, UT_Matrix4 local2World, int numRay)
+	/// <summary>
+	/// rebuild the tables unless they were built for the same counts.
+	/// </summary>
+	void Ensure(int numRay, int numBarycentric)
 	{
-		constexpr float PI = 3.141592653589793238;
-		pos += normal * epsilon;
-		for (int i = 0; i < numRay; ++i)
-		{
-			double u = Hammersley(0, i, numRay);
-			double v = Hammersley(1, i, numRay);
-			double r = std::sqrt(1.0 - u * u);
-			double phi = 2 * PI * v;
-			auto sample = UT_Vector3(std::cos(phi) * r, u, std::sin(phi) * r);
-			sample = Transform(local2World, sample);
-			UT_Vector3 dir = sample;
-			dir.normalize();
-			Ray* ray = Ray::Allocate();
-			ray->ox = pos.x();
-			ray->oy = pos.y();
-			ray->oz = pos.z();
-			ray->dx = dir.x();
-			ray->dy = dir.y();
-			ray->dz = dir.z();
-			ray->primId = _currentPrim;
-			_rays.append(ray);
-		}
-	}
-	void SetupSampleRaysForEachTriangle()
-	{
-		if (_primIndicesBuffer.size() < 3)
+		numRay = SYSmax(numRay, 0);
+		numBarycentric = SYSmax(numBarycentric, 0);
+		if (numRay != _numRay)
 		{
-			return;
-		}
-		int ia = _pGeom->pointOffset(_primIndicesBuffer[0]);
-		int ib = _pGeom->pointOffset(_primIndicesBuffer[1]);
-		for (int i = 2; i < _primIndicesBuffer.size(); ++i)
-		{
-			int ic = _pGeom->pointOffset(_primIndicesBuffer[i]);
-			UT_Vector3 pa, pb, pc;
-			pa = _pGeom->getPos3(ia);
-			pb = _pGeom->getPos3(ib);
-			pc = _pGeom->getPos3(ic);
-			UT_Vector3 ab = pb - pa;
-			ab.normalize();
-			UT_Vector3 ac = pc - pa;
-			ac.normalize();
-			auto offset = _pGeom->primitiveOffset(_currentPrim);
-			UT_Vector3 normal = _primNormalAttr.get(offset);
-			normal.normalize();
-			UT_Matrix4 local2World;
-			float rawData[4][4];
-			UT_Vector3 binormal = ab;
-			binormal.cross(normal);		// inplace cross
-			binormal.normalize();
-			rawData[0][0] = ab.x(); rawData[0][1] = normal.x(); rawData[0][2] = binormal.x(); rawData[0][3] = 0;
-			rawData[1][0] = ab.y(); rawData[1][1] = normal.y(); rawData[1][2] = binormal.y(); rawData[1][3] = 0;
-			rawData[2][0] = ab.z(); rawData[2][1] = normal.z(); rawData[2][2] = binormal.z(); rawData[2][3] = 0;
-			rawData[3][0] = rawData[3][1] = rawData[3][2] = 0; rawData[3][3] = 1;
-			local2World = UT_Matrix4(rawData);
-			//local2World.transpose();
-			UT_Vector3 centerPos = (pa + pb + pc) / 3;
-			GenerateHemisphereRays(pa, normal, local2World, _numRay);
-			GenerateHemisphereRays(pb, normal, local2World, _numRay);
-			GenerateHemisphereRays(pc, normal, local2World, _numRay);
-			GenerateHemisphereRays(centerPos, normal, local2World, _numRay);
-			
-			for (int r = 0; r < _numRandomSampleCount; ++r)
+			constexpr double PI = 3.141592653589793238;
+			_numRay = numRay;
+			_directionX.setSizeNoInit(numRay);
+			_directionY.setSizeNoInit(numRay);
+			_directionZ.setSizeNoInit(numRay);
+			for (int i = 0; i < numRay; ++i)
 			{
-				auto triangleCode = InverseBase4(r);
-				UT_Vector3 sample = BasuOwenMapping(triangleCode);
-				sample = sample.x() * pa + sample.y() * pb + sample.z() * pc;
-				GenerateHemisphereRays(sample, normal, local2World, _numRay);
+				double u = Hammersley(0, i, numRay);
+				double v = Hammersley(1, i, numRay);
+				double r = std::sqrt(1.0 - u * u);
+				double phi = 2 * PI * v;
+				_directionX[i] = std::cos(phi) * r;
+				_directionY[i] = u;
+				_directionZ[i] = std::sin(phi) * r;
 			}
-			ib = ic;
+		}
+		if (numBarycentric != _numBarycentric)
+		{
+			_numBarycentric = numBarycentric;
+			_barycentrics.setSizeNoInit(numBarycentric);
+			UTparallelForLightItems(UT_BlockedRange<int>(0, numBarycentric), [this](const UT_BlockedRange<int>& r)
+				{
+					for (int i = r.begin(); i != r.end(); ++i)
+					{
+						_barycentrics[i] = BasuOwenMapping(InverseBase4(i));
+					}
+				});
 		}
 	}
-	void SetupSampleRaysForCurrentPrim()
+	int GetNumDirections() const
 	{
-		_primIndicesBuffer.clear();
-		auto prim = _pGeom->getPrimitiveByIndex(_currentPrim);
-		prim->forEachPoint(
-			[&](int pid)
-			{
-				_primIndicesBuffer.append(pid);
-			}
-		);
-		SetupSampleRaysForEachTriangle();
+		return _directionX.size();
 	}
-	void GoToNextPrim()
+	const float* GetDirectionX() const
 	{
-		++_currentPrim;
+		return _directionX.data();
 	}
-	bool IsEndOfPrimitives()
+	const float* GetDirectionY() const
 	{
-		return _currentPrim == _primNum;
+		return _directionY.data();
 	}
-	Ray* PopRay()
+	const float* GetDirectionZ() const
 	{
-		UT_ASSERT(_currentCursor < _rays.size());
-		return _rays[_currentCursor++];
+		return _directionZ.data();
 	}
-	bool HasRay()
+	UT_Vector3 GetBarycentric(int i) const
 	{
-		return _currentCursor < _rays.size();
+		return i < _barycentrics.size() ? _barycentrics[i] : BasuOwenMapping(InverseBase4(i));
 	}
 };
 
-RayGeneratorCache g_rayGeneratorCache;
-class RayGenerator
+/// <summary>
+/// identifies the content of the two inputs of a scene: the detail, and the data ids of its topology, primitive list and P.
+/// the detail id makes keys of different nodes comparable, so nodes cooking the same upstream geometry share a scene.
+/// the packed details referenced by the input are hashed in as well, their content is built into prototype scenes.
+/// </summary>
+struct SceneKey
 {
-private:
-	const GEO_Detail* _pGeom;
-	int _numRay;
-	int _numRandomSampleCount;
-public:
-	RayGenerator(const GEO_Detail& geom, int numRay, int numRandomSampleCount) : _pGeom(&geom), _numRay(numRay), _numRandomSampleCount(numRandomSampleCount)
-	{}
-	~RayGenerator()
-	{}
-	RayGenerator(const RayGenerator& generator) : _pGeom(generator._pGeom), _numRay(generator._numRay), _numRandomSampleCount(generator._numRandomSampleCount)
-	{}
-	Ray* operator()(tbb::flow_control& fc) const
-	{
-		if (g_rayGeneratorCache.HasRay())
+	struct InputKey
+	{
+		exint detailId = -1;
+		GA_DataId topologyDataId = GA_INVALID_DATAID;
+		GA_DataId primListDataId = GA_INVALID_DATAID;
+		GA_DataId PDataId = GA_INVALID_DATAID;
+		// prototypes aren't refit, so a change of packed content is a change of topology
+		SYS_HashType packedHash = 0;
+		bool operator == (const InputKey& rhs) const
 		{
-			return g_rayGeneratorCache.PopRay();
+			return SameTopology(rhs) && PDataId == rhs.PDataId;
 		}
-		if (!g_rayGeneratorCache.IsInitialized())
+		bool SameTopology(const InputKey& rhs) const
 		{
-			g_rayGeneratorCache.Initialize(*_pGeom, _numRay, _numRandomSampleCount);
+			return detailId == rhs.detailId
+				&& topologyDataId == rhs.topologyDataId
+				&& primListDataId == rhs.primListDataId
+				&& packedHash == rhs.packedHash;
 		}
-		
-		if (g_rayGeneratorCache.IsEndOfPrimitives())
+	} occluder, visibleArea;
+	SceneBuildSettings settings;
+
+	static InputKey MakeInputKey(const GA_Detail& geom)
+	{
+		InputKey key;
+		key.detailId = geom.getUniqueId();
+		key.topologyDataId = geom.getTopology().getDataId();
+		key.primListDataId = geom.getPrimitiveList().getDataId();
+		key.PDataId = geom.getP()->getDataId();
+		key.packedHash = HashPackedDetails(geom);
+		return key;
+	}
+	/// <summary>
+	/// hash the unique id and the topology, primitive list and P data ids of every packed detail of geom.
+	/// </summary>
+	static SYS_HashType HashPackedDetails(const GA_Detail& geom)
+	{
+		SYS_HashType hash = 0;
+		if (!GU_PrimPacked::hasPackedPrimitives(geom))
+		{
+			return hash;
+		}
+		GA_Offset primOff;
+		GA_FOR_ALL_PRIMOFF(&geom, primOff)
 		{
-			g_rayGeneratorCache = RayGeneratorCache();		// initialized global cache
-			fc.stop();
-			return nullptr;
+			const GU_PrimPacked* packed = dynamic_cast<const GU_PrimPacked*>(geom.getPrimitive(primOff));
+			if (packed == nullptr)
+			{
+				continue;
+			}
+			GU_ConstDetailHandle packedDetail = packed->implementation()->getPackedDetail();
+			const GU_Detail* packedGeom = packedDetail.gdp();
+			if (packedGeom == nullptr)
+			{
+				continue;
+			}
+			SYShashCombine(hash, packedGeom->getUniqueId());
+			SYShashCombine(hash, packedGeom->getTopology().getDataId());
+			SYShashCombine(hash, packedGeom->getPrimitiveList().getDataId());
+			SYShashCombine(hash, packedGeom->getP()->getDataId());
 		}
-		g_rayGeneratorCache.SetupSampleRaysForCurrentPrim();
-		g_rayGeneratorCache.GoToNextPrim();
-		// Note: now we assume it should have at least one ray on primitive
-		return g_rayGeneratorCache.PopRay();
+		return hash;
 	}
-};
-
-class VisibilityTestOperator
-{
-private:
-	RayTracingAccelerationStructure* _pAS;
-public:
-	VisibilityTestOperator(RayTracingAccelerationStructure& as) : _pAS(&as)
-	{}
-	~VisibilityTestOperator() {}
-	VisibilityTestOperator(const VisibilityTestOperator& op)
+	static SceneKey Make(const GA_Detail& occluder, const GA_Detail& visibleArea, const SceneBuildSettings& settings)
 	{
-		_pAS = op._pAS;
+		SceneKey key;
+		key.occluder = MakeInputKey(occluder);
+		key.visibleArea = MakeInputKey(visibleArea);
+		key.settings = settings;
+		return key;
 	}
-	Ray* operator()(Ray* ray) const
+	bool operator == (const SceneKey& rhs) const
 	{
-		RayHit hit;
-		_pAS->QueryRayHit(ray->ox, ray->oy, ray->oz, ray->dx, ray->dy, ray->dz, 0.1, std::numeric_limits<float>::infinity(), &hit);
-		ray->visible = hit.isVisible;
-		ray->hitPrim = hit.hitPrim;
-		ray->hitU = hit.hitU;
-		ray->hitV = hit.hitV;
-		ray->hitPos = hit.hitPos;
-		return ray;
+		return occluder == rhs.occluder && visibleArea == rhs.visibleArea && settings == rhs.settings;
+	}
+	/// <summary>
+	/// true if a scene of rhs can be refit into a scene of this key.
+	/// </summary>
+	bool SameTopology(const SceneKey& rhs) const
+	{
+		return occluder.SameTopology(rhs.occluder) && visibleArea.SameTopology(rhs.visibleArea) && settings == rhs.settings;
+	}
+};
+
+/// <summary>
+/// process wide, reference counted cache of the scenes of all OcclusionRemover nodes, on one embree device.
+/// nodes acquire the scene of their inputs, so ten nodes cooking the same occluder build one BVH.
+/// scenes no node uses anymore are kept for a while, and the least recently used ones are destroyed
+/// once the scenes take more memory than the budget, set in MB by OCCLUSIONREMOVER_SCENE_BUDGET_MB.
+/// </summary>
+class EmbreeSceneRegistry
+{
+public:
+	// what Acquire did to get the scene for the caller
+	enum Action { kActionReused, kActionBuilt, kActionRefit };
+private:
+	struct Entry
+	{
+		SceneKey key;
+		UT_UniquePtr<RayTracingAccelerationStructure> as;
+		int refCount = 0;
+		exint lastUse = 0;
+		int64 memory = 0;
+		int64 bufferMemory = 0;
+		// false for scenes no other node can share, they're destroyed as soon as they're released
+		bool shared = true;
+		// the scene is built outside the registry lock, under its own lock.
+		// a task lock lets the builder's TBB tasks run while a node needing the same scene waits for it
+		UT_TaskLock buildLock;
+		// read and written under buildLock
+		bool built = false;
+		bool refit = false;
+	};
+	RTCDevice _device;
+	// guards the entries and their reference counts, never held during a build
+	UT_Lock _lock;
+	UT_Array<UT_UniquePtr<Entry>> _entries;
+	exint _useCounter = 0;
+	int64 _budget;
+	SYS_AtomicInt64 _deviceMemory;
+
+	EmbreeSceneRegistry()
+	{
+		// embree runs its builds as TBB tasks in Houdini's scheduler.
+		// threads aren't pinned, they're shared with the rest of Houdini, and they start on the first build
+		_device = rtcNewDevice("set_affinity=0,start_threads=0");
+		_deviceMemory.relaxedStore(0);
+		rtcSetDeviceMemoryMonitorFunction(_device, MonitorMemory, this);
+		const char* budget = std::getenv("OCCLUSIONREMOVER_SCENE_BUDGET_MB");
+		_budget = int64(budget != nullptr ? SYSmax(std::atoi(budget), 0) : 2048) << 20;
+	}
+	static bool MonitorMemory(void* userPtr, ssize_t bytes, bool post)
+	{
+		static_cast<EmbreeSceneRegistry*>(userPtr)->_deviceMemory.add(int64(bytes));
+		return true;
+	}
+	Entry* Find(const SceneKey& key)
+	{
+		for (int i = 0; i < _entries.size(); ++i)
+		{
+			if (_entries[i]->key == key)
+			{
+				return _entries[i].get();
+			}
+		}
+		return nullptr;
+	}
+	/// <summary>
+	/// destroy the least recently used scenes no node holds, until the scenes fit in the budget.
+	/// </summary>
+	void EvictUnused()
+	{
+		while (GetTotalMemoryUsage() > _budget)
+		{
+			int lru = -1;
+			for (int i = 0; i < _entries.size(); ++i)
+			{
+				if (_entries[i]->refCount == 0 && (lru < 0 || _entries[i]->lastUse < _entries[lru]->lastUse))
+				{
+					lru = i;
+				}
+			}
+			if (lru < 0)
+			{
+				break;
+			}
+			_entries[lru]->as->Destroy();
+			_entries.removeIndex(lru);
+		}
+	}
+	/// <summary>
+	/// drop a reference to entry, and destroy it right away if it's unreferenced and can't be shared.
+	/// </summary>
+	void Unreference(Entry* entry)
+	{
+		UT_ASSERT(entry->refCount > 0);
+		if (--entry->refCount > 0 || entry->shared)
+		{
+			return;
+		}
+		entry->as->Destroy();
+		for (int i = 0; i < _entries.size(); ++i)
+		{
+			if (_entries[i].get() == entry)
+			{
+				_entries.removeIndex(i);
+				break;
+			}
+		}
+	}
+	/// <summary>
+	/// bytes allocated by the device plus the mesh buffers of all scenes.
+	/// </summary>
+	int64 GetTotalMemoryUsage() const
+	{
+		int64 total = _deviceMemory.relaxedLoad();
+		for (int i = 0; i < _entries.size(); ++i)
+		{
+			total += _entries[i]->bufferMemory;
+		}
+		return total;
+	}
+	/// <summary>
+	/// build the scene of entry unless another node already did, or refit it, and return what was done.
+	/// memory is set to its estimated bytes and bufferMemory to the bytes of its mesh buffers when it was built here.
+	/// called without the registry lock, the caller holds a reference to entry so it can't be evicted.
+	/// </summary>
+	Action Build(Entry& entry, const GA_Detail& occluder, const GA_Detail& visibleArea, int64& memory, int64& bufferMemory)
+	{
+		UT_TaskLock::Scope scope(entry.buildLock);
+		if (entry.built)
+		{
+			return kActionReused;
+		}
+		entry.built = true;
+		if (entry.refit)
+		{
+			entry.as->UpdatePositions(occluder, visibleArea);
+			return kActionRefit;
+		}
+		int64 before = _deviceMemory.relaxedLoad();
+		entry.as->Initialize(_device, occluder, visibleArea, entry.key.settings);
+		// the shared mesh buffers are ours, the monitor only sees embree's own allocations.
+		// builds of other scenes running at the same time are counted as well, so this is an estimate for reporting,
+		// the budget is checked against the device total
+		bufferMemory = entry.as->GetBufferMemoryUsage();
+		memory = _deviceMemory.relaxedLoad() - before + bufferMemory;
+		return kActionBuilt;
+	}
+public:
+	static EmbreeSceneRegistry& Get()
+	{
+		// never destroyed: node caches may be deleted after the static destructors ran at exit
+		static EmbreeSceneRegistry* theRegistry = new EmbreeSceneRegistry();
+		return *theRegistry;
+	}
+	/// <summary>
+	/// return the scene of key, built from occluder and visibleArea unless a node already holds it or it's still cached.
+	/// pPrevious is the key of the scene the caller held so far, or nullptr, and is released.
+	/// a previous scene nobody else holds is refit in place when only P changed.
+	/// shared is false if no other node can ever ask for key, then the scene isn't kept once released.
+	/// action is set to whether the scene was built, refit or reused by this call.
+	/// </summary>
+	RayTracingAccelerationStructure* Acquire(const SceneKey& key, const SceneKey* pPrevious,
+		const GA_Detail& occluder, const GA_Detail& visibleArea, Action& action, bool shared = true)
+	{
+		Entry* entry;
+		{
+			UT_AutoLock lock(_lock);
+			Entry* previous = pPrevious != nullptr ? Find(*pPrevious) : nullptr;
+			entry = Find(key);
+			if (entry == nullptr && previous != nullptr && previous->refCount == 1 && previous->key.SameTopology(key))
+			{
+				// only P changed: the scene is refit in place under the new key, our reference moves with it
+				UT_TaskLock::Scope scope(previous->buildLock);
+				entry = previous;
+				entry->key = key;
+				entry->built = false;
+				entry->refit = true;
+			}
+			else
+			{
+				if (entry == nullptr)
+				{
+					_entries.append(UTmakeUnique<Entry>());
+					entry = _entries.last().get();
+					entry->key = key;
+					entry->as = UTmakeUnique<RayTracingAccelerationStructure>();
+					entry->shared = shared;
+				}
+				++entry->refCount;
+				if (previous != nullptr)
+				{
+					Unreference(previous);
+				}
+			}
+			entry->lastUse = ++_useCounter;
+		}
+		// nodes needing the same key wait for each other here, other builds run concurrently
+		int64 memory = 0, bufferMemory = 0;
+		action = Build(*entry, occluder, visibleArea, memory, bufferMemory);
+		UT_AutoLock lock(_lock);
+		if (action == kActionBuilt)
+		{
+			entry->memory = memory;
+			entry->bufferMemory = bufferMemory;
+		}
+		EvictUnused();
+		return entry->as.get();
+	}
+	/// <summary>
+	/// estimated bytes of the scene of key, or 0 if it's not in the registry.
+	/// </summary>
+	int64 GetMemoryUsage(const SceneKey& key)
+	{
+		UT_AutoLock lock(_lock);
+		Entry* entry = Find(key);
+		return entry != nullptr ? entry->memory : 0;
+	}
+	void Release(const SceneKey& key)
+	{
+		UT_AutoLock lock(_lock);
+		Entry* entry = Find(key);
+		UT_ASSERT(entry != nullptr);
+		if (entry != nullptr)
+		{
+			Unreference(entry);
+		}
+		EvictUnused();
+	}
+};
+
+class SOP_OcclusionRemoverCache : public SOP_NodeCache
+{
+private:
+	// scenes are shared with the other nodes through EmbreeSceneRegistry, and released with the cache
+	RayTracingAccelerationStructure* _pAS = nullptr;
+	SceneKey _asKey;
+	// scene of the viewpoints method, where the occludee takes the place of the visible area
+	RayTracingAccelerationStructure* _pViewAS = nullptr;
+	SceneKey _viewASKey;
+	// what the last cook did to get its scene, and its report for the node info
+	EmbreeSceneRegistry::Action _sceneAction = EmbreeSceneRegistry::kActionReused;
+	UT_StringHolder _sceneInfo;
+
+	// bumped whenever the scene is rebuilt, the cached occludee results are only valid for one scene version
+	int _sceneVersion = 0;
+	struct OccludeeResultKey
+	{
+		static constexpr int64 kNoMeanArea = std::numeric_limits<int64>::min();
+		int sceneVersion = -1;
+		int numRay = -1;
+		int numRandomSample = -1;
+		int maxSamplePoints = -1;
+		// the adaptive budgets of every primitive scale with the mean triangle area of the whole occludee
+		int64 meanAreaKey = kNoMeanArea;
+		// hash of the ray log parameters, 0 when the log is off
+		SYS_HashType rayLogKey = 0;
+		bool operator == (const OccludeeResultKey& rhs) const
+		{
+			return sceneVersion == rhs.sceneVersion
+				&& numRay == rhs.numRay
+				&& numRandomSample == rhs.numRandomSample
+				&& maxSamplePoints == rhs.maxSamplePoints
+				&& meanAreaKey == rhs.meanAreaKey
+				&& rayLogKey == rhs.rayLogKey;
+		}
+	} _occludeeResultKey;
+	UT_Array<uint64> _primHashes;
+	UT_Array<bool> _primVisibility;
+	UT_Array<bool> _primResultValid;
+
+	RaySampleTables _sampleTables;
+public:
+    SOP_OcclusionRemoverCache() : SOP_NodeCache()
+    {
+	}
+    virtual ~SOP_OcclusionRemoverCache() 
+	{
+		if (_pAS != nullptr)
+		{
+			EmbreeSceneRegistry::Get().Release(_asKey);
+		}
+		if (_pViewAS != nullptr)
+		{
+			EmbreeSceneRegistry::Get().Release(_viewASKey);
+		}
+	}
+	
+	void EnsureCache(const GA_Detail& occluder, const GA_Detail& visibleArea, const SceneBuildSettings& settings)
+	{
+		SceneKey key = SceneKey::Make(occluder, visibleArea, settings);
+		if (_pAS != nullptr && key == _asKey)
+		{
+			_sceneAction = EmbreeSceneRegistry::kActionReused;
+			return;
+		}
+		_pAS = EmbreeSceneRegistry::Get().Acquire(key, _pAS != nullptr ? &_asKey : nullptr, occluder, visibleArea, _sceneAction);
+		_asKey = key;
+		++_sceneVersion;
+	}
+
+	/// <summary>
+	/// same as EnsureCache for the scene of the viewpoints method, made of the occluder and the occludee.
+	/// the occludee is this node's output detail, so no other node can share the scene and it isn't kept in the registry.
+	/// </summary>
+	void EnsureViewCache(const GA_Detail& occluder, const GA_Detail& occludee, const SceneBuildSettings& settings)
+	{
+		SceneKey key = SceneKey::Make(occluder, occludee, settings);
+		if (_pViewAS != nullptr && key == _viewASKey)
+		{
+			_sceneAction = EmbreeSceneRegistry::kActionReused;
+			return;
+		}
+		_pViewAS = EmbreeSceneRegistry::Get().Acquire(key, _pViewAS != nullptr ? &_viewASKey : nullptr, occluder, occludee, _sceneAction, false);
+		_viewASKey = key;
+	}
+	RayTracingAccelerationStructure& GetViewAccelerationStructureRef()
+	{
+		return *_pViewAS;
+	}
+	EmbreeSceneRegistry::Action GetSceneAction() const
+	{
+		return _sceneAction;
+	}
+	void SetSceneInfo(const UT_StringHolder& info)
+	{
+		_sceneInfo = info;
+	}
+	const UT_StringHolder& GetSceneInfo() const
+	{
+		return _sceneInfo;
+	}
+	const SceneKey& GetSceneKey() const
+	{
+		return _asKey;
+	}
+	const SceneKey& GetViewSceneKey() const
+	{
+		return _viewASKey;
+	}
+
+	/// <summary>
+	/// prepare the per primitive results for an occludee of numPrim primitives.
+	/// results traced against another scene or with other ray parameters are dropped,
+	/// the others are kept and reused by primitives whose hash didn't change.
+	/// maxSamplePoints is the cap of the adaptive sampler, or -1 when it's off,
+	/// and meanAreaKey the quantised mean triangle area its budgets were scaled by, or GetNoMeanAreaKey().
+	/// rayLogKey is the hash of the ray log parameters, or 0 when the log is off.
+	/// </summary>
+	void EnsureOccludeeResults(int numPrim, int numRay, int numRandomSample, int maxSamplePoints, int64 meanAreaKey,
+		SYS_HashType rayLogKey)
+	{
+		OccludeeResultKey key;
+		key.sceneVersion = _sceneVersion;
+		key.numRay = numRay;
+		key.numRandomSample = numRandomSample;
+		key.maxSamplePoints = maxSamplePoints;
+		key.meanAreaKey = meanAreaKey;
+		key.rayLogKey = rayLogKey;
+		if (!(key == _occludeeResultKey))
+		{
+			_occludeeResultKey = key;
+			_primResultValid.setSizeNoInit(0);
+		}
+		int oldSize = _primResultValid.size();
+		_primHashes.setSize(numPrim);
+		_primVisibility.setSize(numPrim);
+		_primResultValid.setSize(numPrim);
+		for (int i = oldSize; i < numPrim; ++i)
+		{
+			_primResultValid[i] = false;
+		}
+	}
+	static int64 GetNoMeanAreaKey()
+	{
+		return OccludeeResultKey::kNoMeanArea;
+	}
+	RaySampleTables& GetSampleTablesRef()
+	{
+		return _sampleTables;
+	}
+	UT_Array<uint64>& GetPrimHashesRef()
+	{
+		return _primHashes;
+	}
+	UT_Array<bool>& GetPrimVisibilityRef()
+	{
+		return _primVisibility;
+	}
+	UT_Array<bool>& GetPrimResultValidRef()
+	{
+		return _primResultValid;
+	}
+
+	RayTracingAccelerationStructure& GetRayTracingAccelerationStructureRef()
+	{
+		return *_pAS;
+	}
+
+	/// <summary>
+	/// return pointer to cached occluder vertices buffer.
+	/// return nullptr if cache is not prepared.
+	/// </summary>
+	/// <returns></returns>
+	UT_Array<float>* GetOccluderVerticesRef()
+	{
+		return _pAS != nullptr ? _pAS->GetOccluderVerticesRef() : nullptr;
+	}
+	/// <summary>
+	/// return pointer to cached occluder indices buffer.
+	/// return nullptr if cache is not prepared.
+	/// </summary>
+	/// <returns></returns>
+	UT_Array<uint>* GetOccluderIndicesRef()
+	{
+		return _pAS != nullptr ? _pAS->GetOccluderIndicesRef() : nullptr;
+	}
+	/// <summary>
+	/// return pointer to cached visible area vertices buffer.
+	/// return nullptr if cache is not prepared.
+	/// </summary>
+	/// <returns></returns>
+	UT_Array<float>* GetVisibleAreaVerticesRef()
+	{
+		return _pAS != nullptr ? _pAS->GetVisibleAreaVerticesRef() : nullptr;
+	}
+	/// <summary>
+	/// return pointer to cached visible area indices buffer.
+	/// return nullptr if cache is not prepared.
+	/// </summary>
+	/// <returns></returns>
+	UT_Array<uint>* GetVisibleAreaIndicesRef()
+	{
+		return _pAS != nullptr ? _pAS->GetVisibleAreaIndicesRef() : nullptr;
+	}
+};
+
+/// <summary>
+/// up to kMaxSize rays from the same sample point, traced together.
+/// the ray data is stored as structure of arrays to match RTCRayHit8.
+/// packets are stored by value in the per-thread ray arena, so there's no allocation per ray.
+/// </summary>
+struct RayPacket
+{
+	static constexpr int kMaxSize = 8;
+	int primId;
+	int size;
+	float ox[kMaxSize], oy[kMaxSize], oz[kMaxSize];
+	float dx[kMaxSize], dy[kMaxSize], dz[kMaxSize];
+	RayHit hits[kMaxSize];
+public:
+	void Reset(int prim)
+	{
+		primId = prim;
+		size = 0;
+	}
+	bool IsFull() const
+	{
+		return size == kMaxSize;
+	}
+	void Append(const UT_Vector3& origin, const UT_Vector3& dir)
+	{
+		UT_ASSERT(size < kMaxSize);
+		ox[size] = origin.x();
+		oy[size] = origin.y();
+		oz[size] = origin.z();
+		dx[size] = dir.x();
+		dy[size] = dir.y();
+		dz[size] = dir.z();
+		++size;
+	}
+};
+
+const float epsilon = 1e-6;
+/// <summary>
+/// one fan triangle of a primitive and the frame its hemisphere rays are built in.
+/// </summary>
+struct SampleTriangle
+{
+	UT_Vector3 pa, pb, pc;
+	UT_Vector3 tangent, normal, binormal;
+	float area;
+};
+
+/// <summary>
+/// generates the sample rays of any primitive of the occludee.
+/// it holds no cursor or scratch state. the triangle table is built once by BuildSampleTriangles, after that
+/// every method is const and writes only into the caller's packet buffer,
+/// so one generator is created per cook and shared by all threads, each working on its own primitive range.
+/// </summary>
+class RayGenerator
+{
+private:
+	const GEO_Detail* _pGeom;
+	GA_ROHandleV3 _primNormalAttr;
+	const RaySampleTables* _pTables;
+	int _numRandomSampleCount;
+	// fan triangles of all primitives, and the first triangle of every primitive plus the total
+	UT_Array<SampleTriangle> _triangles;
+	UT_Array<exint> _triangleStart;
+public:
+	RayGenerator(const GEO_Detail& geom, const RaySampleTables& tables, int numRandomSampleCount)
+		:
+		_pGeom(&geom),
+		_primNormalAttr(geom.findFloatTuple(GA_ATTRIB_PRIMITIVE, "Normal")),
+		_pTables(&tables),
+		_numRandomSampleCount(numRandomSampleCount)
+	{}
+
+	void GenerateHemisphereRays(int primId, UT_Vector3 pos, const SampleTriangle& triangle, UT_Array<RayPacket>& packets) const
+	{
+		GenerateHemisphereRays(primId, pos, triangle.tangent, triangle.normal, triangle.binormal, packets);
+	}
+	/// <summary>
+	/// append the hemisphere rays of a sample point around normal, in the frame (tangent, normal, binormal).
+	/// the frame must be orthonormal, the rotated table directions are then unit length without normalizing.
+	/// id is stored in the packets, it's the primitive, or the shared sample the rays belong to.
+	/// </summary>
+	void GenerateHemisphereRays(int id, UT_Vector3 pos, const UT_Vector3& tangent, const UT_Vector3& normal, const UT_Vector3& binormal, UT_Array<RayPacket>& packets) const
+	{
+		pos += normal * epsilon;
+		const int numDirection = _pTables->GetNumDirections();
+		const float* dirX = _pTables->GetDirectionX();
+		const float* dirY = _pTables->GetDirectionY();
+		const float* dirZ = _pTables->GetDirectionZ();
+		// rays of one sample point share an origin, so they're packed
+		// together to keep each packet coherent.
+		for (int first = 0; first < numDirection; first += RayPacket::kMaxSize)
+		{
+			RayPacket& packet = packets(packets.append());
+			packet.Reset(id);
+			packet.size = SYSmin(RayPacket::kMaxSize, numDirection - first);
+			const float* x = dirX + first;
+			const float* y = dirY + first;
+			const float* z = dirZ + first;
+			// rotate the table directions into the frame, straight into the packet arrays
+			for (int i = 0; i < packet.size; ++i)
+			{
+				packet.ox[i] = pos.x();
+				packet.oy[i] = pos.y();
+				packet.oz[i] = pos.z();
+				packet.dx[i] = tangent.x() * x[i] + normal.x() * y[i] + binormal.x() * z[i];
+				packet.dy[i] = tangent.y() * x[i] + normal.y() * y[i] + binormal.y() * z[i];
+				packet.dz[i] = tangent.z() * x[i] + normal.z() * y[i] + binormal.z() * z[i];
+			}
+		}
+	}
+	/// <summary>
+	/// normalized sum of the normals of the primitives using the point, or zero if no primitive does.
+	/// </summary>
+	UT_Vector3 GetPointNormal(GA_Offset ptOff) const
+	{
+		UT_Vector3 normal(0, 0, 0);
+		GA_OffsetArray prims;
+		_pGeom->getPrimitivesReferencingPoint(prims, ptOff);
+		for (exint i = 0; i < prims.size(); ++i)
+		{
+			UT_Vector3 primNormal = _primNormalAttr.isValid() ? _primNormalAttr.get(prims[i]) : _pGeom->getGEOPrimitive(prims[i])->computeNormal();
+			primNormal.normalize();
+			normal += primNormal;
+		}
+		normal.normalize();
+		return normal;
+	}
+	/// <summary>
+	/// append the hemisphere rays of a shared sample point, with a frame built around its normal.
+	/// </summary>
+	void GenerateSharedSampleRays(int id, const UT_Vector3& pos, const UT_Vector3& normal, UT_Array<RayPacket>& packets) const
+	{
+		// any tangent works, the hemisphere table is only rotated around the normal
+		UT_Vector3 axis = SYSabs(normal.x()) < 0.9f ? UT_Vector3(1, 0, 0) : UT_Vector3(0, 1, 0);
+		UT_Vector3 tangent = cross(axis, normal);
+		tangent.normalize();
+		UT_Vector3 binormal = tangent;
+		binormal.cross(normal);		// inplace cross
+		binormal.normalize();
+		GenerateHemisphereRays(id, pos, tangent, normal, binormal, packets);
+	}
+	/// <summary>
+	/// fan triangulate every primitive and build the frame the hemisphere rays of each triangle are generated in.
+	/// the triangles are counted per primitive and prefix summed first, then filled in parallel,
+	/// so the positions and the normal of a primitive are read once instead of once per sample.
+	/// it must be called before the triangle methods are used.
+	/// </summary>
+	void BuildSampleTriangles()
+	{
+		const GA_Size numPrim = _pGeom->getNumPrimitives();
+		_triangleStart.setSizeNoInit(numPrim + 1);
+		UTparallelForLightItems(UT_BlockedRange<GA_Size>(0, numPrim), [this](const UT_BlockedRange<GA_Size>& r)
+			{
+				for (GA_Size primId = r.begin(); primId != r.end(); ++primId)
+				{
+					GA_Size numVertex = _pGeom->getPrimitiveVertexCount(_pGeom->primitiveOffset(primId));
+					_triangleStart[primId] = numVertex >= 3 ? numVertex - 2 : 0;
+				}
+			});
+		exint numTriangle = 0;
+		for (GA_Size primId = 0; primId < numPrim; ++primId)
+		{
+			exint count = _triangleStart[primId];
+			_triangleStart[primId] = numTriangle;
+			numTriangle += count;
+		}
+		_triangleStart[numPrim] = numTriangle;
+
+		_triangles.setSizeNoInit(numTriangle);
+		UTparallelFor(UT_BlockedRange<GA_Size>(0, numPrim), [this](const UT_BlockedRange<GA_Size>& r)
+			{
+				for (GA_Size primId = r.begin(); primId != r.end(); ++primId)
+				{
+					exint first = _triangleStart[primId];
+					exint numTriangle = _triangleStart[primId + 1] - first;
+					if (numTriangle == 0)
+					{
+						continue;
+					}
+					GA_Offset primOff = _pGeom->primitiveOffset(primId);
+					// a Normal attribute is used if the detail has one, otherwise every fan triangle uses its geometric normal
+					const bool hasNormalAttr = _primNormalAttr.isValid();
+					UT_Vector3 normal(0, 0, 0);
+					if (hasNormalAttr)
+					{
+						normal = _primNormalAttr.get(primOff);
+						normal.normalize();
+					}
+					UT_Vector3 pa = _pGeom->getPos3(_pGeom->vertexPoint(_pGeom->getPrimitiveVertexOffset(primOff, 0)));
+					UT_Vector3 pb = _pGeom->getPos3(_pGeom->vertexPoint(_pGeom->getPrimitiveVertexOffset(primOff, 1)));
+					for (exint i = 0; i < numTriangle; ++i)
+					{
+						UT_Vector3 pc = _pGeom->getPos3(_pGeom->vertexPoint(_pGeom->getPrimitiveVertexOffset(primOff, i + 2)));
+						SampleTriangle& triangle = _triangles[first + i];
+						triangle.pa = pa;
+						triangle.pb = pb;
+						triangle.pc = pc;
+						// houdini polygons wind clockwise around their normal
+						UT_Vector3 faceNormal = cross(pc - pa, pb - pa);
+						float faceNormalLength = faceNormal.length();
+						triangle.area = 0.5f * faceNormalLength;
+						if (!hasNormalAttr)
+						{
+							if (faceNormalLength > 0)
+							{
+								normal = faceNormal / faceNormalLength;
+							}
+							else if (normal.isZero())
+							{
+								// a degenerate triangle keeps the normal of the previous one, or takes the primitive's
+								normal = _pGeom->getGEOPrimitive(primOff)->computeNormal();
+								normal.normalize();
+							}
+						}
+						// the tangent follows the first edge, made orthogonal to the normal
+						UT_Vector3 tangent = pb - pa;
+						tangent -= normal * dot(tangent, normal);
+						tangent.normalize();
+						UT_Vector3 binormal = tangent;
+						binormal.cross(normal);		// inplace cross
+						binormal.normalize();
+						triangle.tangent = tangent;
+						triangle.normal = normal;
+						triangle.binormal = binormal;
+						pb = pc;
+					}
+				}
+			});
+	}
+	exint GetFirstTriangle(int primId) const
+	{
+		return _triangleStart[primId];
+	}
+	exint GetTriangleEnd(int primId) const
+	{
+		return _triangleStart[primId + 1];
+	}
+	const SampleTriangle& GetSampleTriangle(exint t) const
+	{
+		return _triangles[t];
+	}
+	/// <summary>
+	/// append the rays of the fixed samples of a triangle: its corners and its centroid.
+	/// </summary>
+	void GenerateFixedSampleRays(int primId, const SampleTriangle& triangle, UT_Array<RayPacket>& packets) const
+	{
+		UT_Vector3 centerPos = (triangle.pa + triangle.pb + triangle.pc) / 3;
+		GenerateHemisphereRays(primId, triangle.pa, triangle, packets);
+		GenerateHemisphereRays(primId, triangle.pb, triangle, packets);
+		GenerateHemisphereRays(primId, triangle.pc, triangle, packets);
+		GenerateHemisphereRays(primId, centerPos, triangle, packets);
+	}
+	/// <summary>
+	/// append the rays of the random samples [first, first + count) of a triangle.
+	/// the Basu-Owen sequence is stratified for any prefix, so samples can be added a few at a time.
+	/// </summary>
+	void GenerateRandomSampleRays(int primId, const SampleTriangle& triangle, int first, int count, UT_Array<RayPacket>& packets) const
+	{
+		for (int r = first; r < first + count; ++r)
+		{
+			UT_Vector3 sample = _pTables->GetBarycentric(r);
+			sample = sample.x() * triangle.pa + sample.y() * triangle.pb + sample.z() * triangle.pc;
+			GenerateHemisphereRays(primId, sample, triangle, packets);
+		}
+	}
+	int GetNumRandomSampleCount() const
+	{
+		return _numRandomSampleCount;
+	}
+	static void HashCombineVector(SYS_HashType& hash, const UT_Vector3& v)
+	{
+		for (int i = 0; i < 3; ++i)
+		{
+			SYS_FPRealUnionF bits;
+			bits.fval = v[i];
+			SYShashCombine(hash, bits.uval);
+		}
+	}
+	/// <summary>
+	/// hash of everything the rays of the primitive depend on: its point positions and its normal.
+	/// </summary>
+	uint64 HashPrim(int primId) const
+	{
+		SYS_HashType hash = 0;
+		auto prim = _pGeom->getPrimitiveByIndex(primId);
+		prim->forEachPoint(
+			[&](int pid)
+			{
+				HashCombineVector(hash, _pGeom->getPos3(_pGeom->pointOffset(pid)));
+			}
+		);
+		if (_primNormalAttr.isValid())
+		{
+			HashCombineVector(hash, _primNormalAttr.get(_pGeom->primitiveOffset(primId)));
+		}
+		return hash;
+	}
+	/// <summary>
+	/// replaces the content of packets with the sample rays of the primitive.
+	/// packets keeps its capacity, so a buffer reused by one thread works as a ray arena.
+	/// </summary>
+	void SetupSampleRaysForPrim(int primId, UT_Array<RayPacket>& packets) const
+	{
+		packets.clear();
+		for (exint t = GetFirstTriangle(primId); t < GetTriangleEnd(primId); ++t)
+		{
+			GenerateFixedSampleRays(primId, _triangles[t], packets);
+			GenerateRandomSampleRays(primId, _triangles[t], 0, _numRandomSampleCount, packets);
+		}
+	}
+	/// <summary>
+	/// mean area of the fan triangles of all primitives, the reference the adaptive sampler scales its budget by.
+	/// </summary>
+	double ComputeMeanTriangleArea() const
+	{
+		double area = 0;
+		for (exint t = 0; t < _triangles.size(); ++t)
+		{
+			area += _triangles[t].area;
+		}
+		return _triangles.size() > 0 ? area / _triangles.size() : 0;
+	}
+};
+
+/// <summary>
+/// one bit per primitive, set as soon as any ray of the primitive is visible.
+/// it's checked before every packet, so the remaining rays of a visible primitive are skipped before tracing.
+/// </summary>
+class VisibilityBitset
+{
+private:
+	UT_UniquePtr<SYS_AtomicInt32[]> _words;
+	int _numBits = 0;
+public:
+	void Initialize(int numBits)
+	{
+		int numWords = (numBits + 31) / 32;
+		_words.reset(new SYS_AtomicInt32[numWords]);
+		for (int i = 0; i < numWords; ++i)
+		{
+			_words[i].relaxedStore(0);
+		}
+		_numBits = numBits;
+	}
+	bool Test(int i) const
+	{
+		UT_ASSERT(i >= 0 && i < _numBits);
+		return (uint32(_words[i >> 5].relaxedLoad()) & (1u << (i & 31))) != 0;
+	}
+	void Set(int i)
+	{
+		UT_ASSERT(i >= 0 && i < _numBits);
+		SYS_AtomicInt32& word = _words[i >> 5];
+		// shifted unsigned, 1 << 31 overflows a signed int
+		const int32 bit = int32(1u << (i & 31));
+		int32 old = word.relaxedLoad();
+		while (!(old & bit))
+		{
+			int32 prev = word.compare_swap(old, old | bit);
+			if (prev == old)
+			{
+				break;
+			}
+			old = prev;
+		}
+	}
+};
+
+/// <summary>
+/// per-thread storage of the visibility test.
+/// the packet buffer is the ray arena, reused by every primitive the thread processes.
+/// </summary>
+struct VisibilityTestLocalStorage
+{
+	UT_Array<RayPacket> packets;
+};
+
+/// <summary>
+/// diagnostic log of a subset of the traced rays, in a ring buffer allocated once per cook.
+/// a ray is logged if its source primitive is selected, or, without a selection, with probability fraction.
+/// the choice is a hash of the ray, so the same rays are logged on every cook.
+/// once the buffer is full, the oldest rays are overwritten.
+/// </summary>
+class RayLog
+{
+public:
+	static constexpr int kEscaped = 0;
+	static constexpr int kOccluded = 1;
+	static constexpr int kVisible = 2;
+	// the input a logged ray hit, numbered as the node's inputs
+	static constexpr int kHitNone = -1;
+	static constexpr int kHitOccluder = 1;
+	static constexpr int kHitVisibleArea = 2;
+	struct Entry
+	{
+		UT_Vector3 origin;
+		UT_Vector3 dir;
+		UT_Vector3 hitPos;
+		int sourceId;
+		// primitive number in hitInput, or -1 on a miss
+		int hitPrim;
+		int hitInput;
+		int status;
+	};
+private:
+	/// <summary>
+	/// ring buffer of the rays logged by one thread, so threads never write the same entry.
+	/// </summary>
+	struct ThreadLog
+	{
+		UT_Array<Entry> entries;
+		exint numRecorded = 0;
+	};
+	UT_ThreadSpecificValue<ThreadLog> _threadLogs;
+	// the logs of all threads, filled by Merge
+	UT_Array<Entry> _entries;
+	exint _capacity = 1;
+	uint32 _threshold = 0;
+	const UT_BitArray* _pSelected = nullptr;
+public:
+	/// <summary>
+	/// pSelected is the selection of source ids, or nullptr to log a random fraction of all rays.
+	/// </summary>
+	void Initialize(exint capacity, float fraction, const UT_BitArray* pSelected)
+	{
+		_capacity = SYSmax(capacity, exint(1));
+		_entries.clear();
+		_threshold = uint32(SYSclamp(fraction, 0.0f, 1.0f) * 0xffffff);
+		_pSelected = pSelected;
+	}
+	bool ShouldRecord(const RayPacket& packet, int i) const
+	{
+		if (_pSelected != nullptr)
+		{
+			return packet.primId < _pSelected->size() && _pSelected->getBitFast(packet.primId);
+		}
+		SYS_HashType hash = packet.primId;
+		RayGenerator::HashCombineVector(hash, UT_Vector3(packet.dx[i], packet.dy[i], packet.dz[i]));
+		RayGenerator::HashCombineVector(hash, UT_Vector3(packet.ox[i], packet.oy[i], packet.oz[i]));
+		return uint32(hash & 0xffffff) < _threshold;
+	}
+	/// <summary>
+	/// log the picked rays of packet, traced in as with QueryRayHit8.
+	/// </summary>
+	void Record(const RayTracingAccelerationStructure& as, const RayPacket& packet)
+	{
+		ThreadLog* pLog = nullptr;
+		for (int i = 0; i < packet.size; ++i)
+		{
+			if (!ShouldRecord(packet, i))
+			{
+				continue;
+			}
+			if (pLog == nullptr)
+			{
+				pLog = &_threadLogs.get();
+			}
+			// every thread keeps its last capacity rays, the buffer only grows as far as it's used
+			if (pLog->entries.size() < _capacity)
+			{
+				pLog->entries.append();
+			}
+			Entry& entry = pLog->entries(pLog->numRecorded++ % _capacity);
+			const RayHit& hit = packet.hits[i];
+			entry.origin = UT_Vector3(packet.ox[i], packet.oy[i], packet.oz[i]);
+			entry.dir = UT_Vector3(packet.dx[i], packet.dy[i], packet.dz[i]);
+			entry.hitPos = hit.hitPos;
+			entry.sourceId = packet.primId;
+			entry.status = hit.isVisible ? kVisible : (hit.isOccluded ? kOccluded : kEscaped);
+			// embree reports fan triangles, or triangles of a prototype, they're mapped back to primitives of the inputs
+			if (hit.isVisible)
+			{
+				entry.hitInput = kHitVisibleArea;
+				entry.hitPrim = as.GetVisibleAreaPrim(hit.hitPrim);
+			}
+			else if (hit.isOccluded)
+			{
+				entry.hitInput = kHitOccluder;
+				entry.hitPrim = as.GetOccluderPrim(hit);
+			}
+			else
+			{
+				entry.hitInput = kHitNone;
+				entry.hitPrim = -1;
+			}
+		}
+	}
+	/// <summary>
+	/// gather the logs of all threads once tracing is done, oldest first within each thread.
+	/// if they hold more than capacity rays together, an evenly spread subset is kept so no thread is favoured.
+	/// </summary>
+	void Merge()
+	{
+		UT_Array<Entry> all;
+		for (auto it = _threadLogs.begin(); it != _threadLogs.end(); ++it)
+		{
+			const ThreadLog& log = it.get();
+			const exint size = log.entries.size();
+			const exint first = log.numRecorded > size ? log.numRecorded % size : 0;
+			for (exint i = 0; i < size; ++i)
+			{
+				all.append(log.entries[(first + i) % size]);
+			}
+		}
+		const exint numKept = SYSmin(exint(all.size()), _capacity);
+		_entries.setSizeNoInit(numKept);
+		for (exint i = 0; i < numKept; ++i)
+		{
+			_entries[i] = all[i * all.size() / numKept];
+		}
+	}
+	exint GetNumEntries() const
+	{
+		return _entries.size();
+	}
+	/// <summary>
+	/// i-th logged ray after Merge.
+	/// </summary>
+	const Entry& GetEntry(exint i) const
+	{
+		return _entries[i];
+	}
+};
+
+/// <summary>
+/// trace one packet, with the cheaper visibility query when only the visibility is needed.
+/// the rays picked by pRayLog, if any, are recorded with their full hit.
+/// </summary>
+void TraceRayPacket(RayTracingAccelerationStructure& as, RayPacket& packet, RayLog* pRayLog)
+{
+	// the ray log needs the hit positions, which the visibility query doesn't compute
+	const bool visibilityOnly = pRayLog == nullptr && as.SupportsVisibilityQuery();
+	if (visibilityOnly)
+	{
+		as.QueryVisibility8(packet.size,
+			packet.ox, packet.oy, packet.oz,
+			packet.dx, packet.dy, packet.dz,
+			0.1, std::numeric_limits<float>::infinity(), packet.hits);
+	}
+	else
+	{
+		as.QueryRayHit8(packet.size,
+			packet.ox, packet.oy, packet.oz,
+			packet.dx, packet.dy, packet.dz,
+			0.1, std::numeric_limits<float>::infinity(), packet.hits);
+	}
+	if (pRayLog != nullptr)
+	{
+		pRayLog->Record(as, packet);
+	}
+}
+
+/// <summary>
+/// trace packets until one ray is visible, and mark id visible in visibleBits.
+/// numRay and numEscaped accumulate the traced rays and the ones that hit neither the occluder nor the visible area.
+/// return true if id is visible.
+/// </summary>
+bool TraceRayPackets(RayTracingAccelerationStructure& as, VisibilityBitset& visibleBits, int id,
+	UT_Array<RayPacket>& packets, RayLog* pRayLog, int& numRay, int& numEscaped)
+{
+	for (exint p = 0; p < packets.size(); ++p)
+	{
+		// one visible ray is enough, the rest of a visible primitive or sample doesn't need to be traced
+		if (visibleBits.Test(id))
+		{
+			return true;
+		}
+		RayPacket& packet = packets(p);
+		TraceRayPacket(as, packet, pRayLog);
+		numRay += packet.size;
+		for (int i = 0; i < packet.size; ++i)
+		{
+			const RayHit& hit = packet.hits[i];
+			if (hit.isVisible)
+			{
+				visibleBits.Set(id);
+			}
+			else if (!hit.isOccluded)
+			{
+				++numEscaped;
+			}
+		}
+	}
+	return visibleBits.Test(id);
+}
+
+/// <summary>
+/// settings of the adaptive sampler.
+/// every triangle starts with its fixed samples, then takes random samples in small rounds up to a budget
+/// scaled by its area. partially exposed triangles, where some rays escape the occluders, double the budget up to maxSamplePoints.
+/// </summary>
+struct AdaptiveSamplingSettings
+{
+	static constexpr int kRoundSize = 4;
+	bool enabled = false;
+	int maxSamplePoints = 64;
+	double meanTriangleArea = 0;
+};
+
+/// <summary>
+/// tests a chunk of primitives: generates the rays of each primitive into the thread's arena,
+/// traces them packet by packet and marks the primitive visible.
+/// there's no serial stage, every chunk only writes the visibility of its own primitives.
+/// </summary>
+class VisibilityTestOperator
+{
+private:
+	const RayGenerator* _pGenerator;
+	RayTracingAccelerationStructure* _pAS;
+	VisibilityBitset* _pVisibleBits;
+	UT_ThreadSpecificValue<VisibilityTestLocalStorage>* _pLocalStorage;
+	SOP_OcclusionRemoverCache* _pCache;
+	AdaptiveSamplingSettings _adaptive;
+	RayLog* _pRayLog;
+public:
+	VisibilityTestOperator(
+		const RayGenerator& generator,
+		SOP_OcclusionRemoverCache& cache,
+		VisibilityBitset& visibleBits,
+		UT_ThreadSpecificValue<VisibilityTestLocalStorage>& localStorage,
+		const AdaptiveSamplingSettings& adaptive,
+		RayLog* pRayLog)
+		:
+		_pGenerator(&generator),
+		_pAS(&cache.GetRayTracingAccelerationStructureRef()),
+		_pVisibleBits(&visibleBits),
+		_pLocalStorage(&localStorage),
+		_pCache(&cache),
+		_adaptive(adaptive),
+		_pRayLog(pRayLog)
+	{}
+	/// <summary>
+	/// trace the packets of a primitive until one ray is visible.
+	/// numRay and numEscaped accumulate the traced rays and the ones that hit neither the occluder nor the visible area.
+	/// return true if the primitive is visible.
+	/// </summary>
+	bool TracePackets(int primId, UT_Array<RayPacket>& packets, int& numRay, int& numEscaped) const
+	{
+		return TraceRayPackets(*_pAS, *_pVisibleBits, primId, packets, _pRayLog, numRay, numEscaped);
+	}
+	void TestPrim(int primId, VisibilityTestLocalStorage& local) const
+	{
+		int numRay = 0;
+		int numEscaped = 0;
+		_pGenerator->SetupSampleRaysForPrim(primId, local.packets);
+		TracePackets(primId, local.packets, numRay, numEscaped);
+	}
+	/// <summary>
+	/// trace the fixed samples of every triangle of a primitive, then random samples in small rounds until one ray is visible.
+	/// the random budget of a triangle scales with its area relative to the mean, capped by maxSamplePoints.
+	/// only the area scales it: the rays traced so far are all blocked, and escaped rays say nothing about how close
+	/// the triangle is to being visible, they don't exist inside a dome, and through a small window they're the norm.
+	/// </summary>
+	void TestPrimAdaptive(int primId, VisibilityTestLocalStorage& local) const
+	{
+		UT_Array<RayPacket>& packets = local.packets;
+		const int maxSamplePoints = SYSmax(_adaptive.maxSamplePoints, 0);
+		for (exint t = _pGenerator->GetFirstTriangle(primId); t < _pGenerator->GetTriangleEnd(primId); ++t)
+		{
+			const SampleTriangle& triangle = _pGenerator->GetSampleTriangle(t);
+			int numRay = 0;
+			int numEscaped = 0;
+			packets.clear();
+			_pGenerator->GenerateFixedSampleRays(primId, triangle, packets);
+			if (TracePackets(primId, packets, numRay, numEscaped))
+			{
+				return;
+			}
+			double areaRatio = _adaptive.meanTriangleArea > 0 ? triangle.area / _adaptive.meanTriangleArea : 1;
+			int budget = SYSclamp((int)SYSceil(_pGenerator->GetNumRandomSampleCount() * areaRatio), 1, maxSamplePoints);
+			int sampled = 0;
+			while (sampled < budget)
+			{
+				int count = SYSmin(AdaptiveSamplingSettings::kRoundSize, budget - sampled);
+				packets.clear();
+				_pGenerator->GenerateRandomSampleRays(primId, triangle, sampled, count, packets);
+				if (TracePackets(primId, packets, numRay, numEscaped))
+				{
+					return;
+				}
+				sampled += count;
+			}
+		}
+	}
+	void operator()(const UT_BlockedRange<int>& range) const
+	{
+		VisibilityTestLocalStorage& local = _pLocalStorage->get();
+		UT_Array<uint64>& primHashes = _pCache->GetPrimHashesRef();
+		UT_Array<bool>& primVisibility = _pCache->GetPrimVisibilityRef();
+		UT_Array<bool>& primResultValid = _pCache->GetPrimResultValidRef();
+		for (int primId = range.begin(); primId != range.end(); ++primId)
+		{
+			// every primitive is owned by one chunk, so its cache slot can be read and written without locking
+			uint64 hash = _pGenerator->HashPrim(primId);
+			// a cached primitive traces no ray, so the log would miss it
+			if (_pRayLog == nullptr && primResultValid[primId] && primHashes[primId] == hash)
+			{
+				if (primVisibility[primId])
+				{
+					_pVisibleBits->Set(primId);
+				}
+				continue;
+			}
+			if (_adaptive.enabled)
+			{
+				TestPrimAdaptive(primId, local);
+			}
+			else
+			{
+				TestPrim(primId, local);
+			}
+			primHashes[primId] = hash;
+			primVisibility[primId] = _pVisibleBits->Test(primId);
+			primResultValid[primId] = true;
+		}
+	}
+};
+
+/// <summary>
+/// per primitive results of the progressive mode.
+/// every ray of a primitive is traced and counted, instead of stopping at the first visible one.
+/// </summary>
+struct ProgressiveResults
+{
+	UT_Array<int> numRay;
+	UT_Array<int> numVisible;
+	UT_Array<bool> settled;
+	void Initialize(int numPrim)
+	{
+		numRay.setSize(numPrim);
+		numRay.constant(0);
+		numVisible.setSize(numPrim);
+		numVisible.constant(0);
+		settled.setSize(numPrim);
+		settled.constant(false);
+	}
+	float VisibleFraction(int primId) const
+	{
+		return numRay[primId] > 0 ? float(numVisible[primId]) / numRay[primId] : 0.0f;
+	}
+	/// <summary>
+	/// a primitive is settled once the 95% interval of its visible fraction is narrower than tolerance on each side.
+	/// the estimate counts one extra visible and one extra hidden ray, so a few rays that all agree don't settle it.
+	/// </summary>
+	static bool IsSettled(int numVisible, int numRay, float tolerance)
+	{
+		double p = (numVisible + 1.0) / (numRay + 2.0);
+		return 1.96 * SYSsqrt(p * (1 - p) / (numRay + 2.0)) < tolerance;
+	}
+	/// <summary>
+	/// number of random samples per triangle traced once pass is done.
+	/// every pass takes twice the samples of the previous one, and the last pass reaches numRandomSample.
+	/// </summary>
+	static int SampleCountAfterPass(int pass, int numPasses, int numRandomSample)
+	{
+		double total = SYSpow(2.0, numPasses) - 1;
+		return (int)SYSceil(numRandomSample * (SYSpow(2.0, pass + 1) - 1) / total);
+	}
+};
+
+/// <summary>
+/// one pass of the progressive mode over a chunk of primitives.
+/// the first pass traces the fixed samples, every pass traces the random samples [firstSample, firstSample + numSample)
+/// of the primitives that are not settled yet.
+/// </summary>
+class ProgressiveVisibilityOperator
+{
+private:
+	const RayGenerator* _pGenerator;
+	RayTracingAccelerationStructure* _pAS;
+	ProgressiveResults* _pResults;
+	UT_ThreadSpecificValue<VisibilityTestLocalStorage>* _pLocalStorage;
+	bool _firstPass;
+	int _firstSample;
+	int _numSample;
+	float _tolerance;
+	RayLog* _pRayLog;
+public:
+	ProgressiveVisibilityOperator(
+		const RayGenerator& generator,
+		RayTracingAccelerationStructure& as,
+		ProgressiveResults& results,
+		UT_ThreadSpecificValue<VisibilityTestLocalStorage>& localStorage,
+		bool firstPass, int firstSample, int numSample, float tolerance,
+		RayLog* pRayLog)
+		:
+		_pGenerator(&generator),
+		_pAS(&as),
+		_pResults(&results),
+		_pLocalStorage(&localStorage),
+		_firstPass(firstPass),
+		_firstSample(firstSample),
+		_numSample(numSample),
+		_tolerance(tolerance),
+		_pRayLog(pRayLog)
+	{}
+	void operator()(const UT_BlockedRange<int>& range) const
+	{
+		VisibilityTestLocalStorage& local = _pLocalStorage->get();
+		UT_Array<RayPacket>& packets = local.packets;
+		for (int primId = range.begin(); primId != range.end(); ++primId)
+		{
+			if (_pResults->settled[primId])
+			{
+				continue;
+			}
+			const exint firstTriangle = _pGenerator->GetFirstTriangle(primId);
+			const exint triangleEnd = _pGenerator->GetTriangleEnd(primId);
+			if (firstTriangle == triangleEnd)
+			{
+				_pResults->settled[primId] = true;
+				continue;
+			}
+			packets.clear();
+			for (exint t = firstTriangle; t < triangleEnd; ++t)
+			{
+				const SampleTriangle& triangle = _pGenerator->GetSampleTriangle(t);
+				if (_firstPass)
+				{
+					_pGenerator->GenerateFixedSampleRays(primId, triangle, packets);
+				}
+				_pGenerator->GenerateRandomSampleRays(primId, triangle, _firstSample, _numSample, packets);
+			}
+			int numRay = 0;
+			int numVisible = 0;
+			for (exint p = 0; p < packets.size(); ++p)
+			{
+				RayPacket& packet = packets(p);
+				TraceRayPacket(*_pAS, packet, _pRayLog);
+				numRay += packet.size;
+				for (int i = 0; i < packet.size; ++i)
+				{
+					numVisible += packet.hits[i].isVisible;
+				}
+			}
+			// every primitive is owned by one chunk, so its results are written without locking
+			_pResults->numRay[primId] += numRay;
+			_pResults->numVisible[primId] += numVisible;
+			_pResults->settled[primId] = ProgressiveResults::IsSettled(
+				_pResults->numVisible[primId], _pResults->numRay[primId], _tolerance);
+		}
 	}
 };
 
-class VisibilityMarker
+/// <summary>
+/// point based sampling.
+/// every unique point, and a lattice of samples on every unique edge, is tested once however many primitives share it,
+/// then a primitive is visible if any of its points or edges is.
+/// </summary>
+class SharedSampleVisibility
 {
 private:
-	UT_Array<bool>* _visibilityOfPrim;
-#ifdef _DEBUG
-	UT_Array<UT_Vector3>* _rayOrigin;
-	UT_Array<UT_Vector3>* _rayDir;
-	UT_Array<int>* _hitPrim;
-	UT_Array<UT_Vector2>* _hitUV;
-	UT_Array<bool>* _hitVisible;
-	UT_Array<UT_Vector3>* _hitPos;
-#endif
+	const GEO_Detail* _pGeom;
+	const RayGenerator* _pGenerator;
+	RayTracingAccelerationStructure* _pAS;
+	RayLog* _pRayLog;
+	int _edgeSampleCount;
+	// unique edges as (smaller point index << 32 | larger point index), sorted
+	UT_Array<uint64> _edges;
+	UT_Array<UT_Vector3> _pointNormals;
+	VisibilityBitset _pointBits;
+	VisibilityBitset _edgeBits;
 public:
-	VisibilityMarker(
-		UT_Array<bool>& visibilityOfPrim 
-#ifdef _DEBUG
-		, UT_Array<UT_Vector3>* pRayOrigin = nullptr, 
-		UT_Array<UT_Vector3>* pRayDir = nullptr,
-		UT_Array<int>* pHitPrim = nullptr,
-		UT_Array<UT_Vector2>* pHitUV = nullptr,
-		UT_Array<bool>* pHitVisible = nullptr,
-		UT_Array<UT_Vector3>* pHitPos = nullptr
-#endif
-	) 
-		: 
-		_visibilityOfPrim(&visibilityOfPrim)
-#ifdef _DEBUG
-		, _rayOrigin(pRayOrigin), 
-		_rayDir(pRayDir),
-		_hitPrim(pHitPrim),
-		_hitUV(pHitUV),
-		_hitVisible(pHitVisible),
-		_hitPos(pHitPos)
-#endif
-	{}
-	VisibilityMarker(const VisibilityMarker& op) 
-		: 
-		_visibilityOfPrim(op._visibilityOfPrim)
-#ifdef _DEBUG
-		, _rayOrigin(op._rayOrigin), 
-		_rayDir(op._rayDir),
-		_hitPrim(op._hitPrim),
-		_hitUV(op._hitUV),
-		_hitVisible(op._hitVisible),
-		_hitPos(op._hitPos)
-#endif
+	SharedSampleVisibility(const GEO_Detail& geom, const RayGenerator& generator, RayTracingAccelerationStructure& as, int edgeSampleCount,
+		RayLog* pRayLog)
+		:
+		_pGeom(&geom),
+		_pGenerator(&generator),
+		_pAS(&as),
+		_pRayLog(pRayLog),
+		_edgeSampleCount(SYSmax(edgeSampleCount, 0))
 	{}
+	static uint64 EdgeKey(GA_Index a, GA_Index b)
+	{
+		if (a > b)
+		{
+			std::swap(a, b);
+		}
+		return (uint64(a) << 32) | uint64(b);
+	}
+	void CollectEdges()
+	{
+		const GA_Size numPrim = _pGeom->getNumPrimitives();
+		UT_Array<exint> edgeStart;
+		edgeStart.setSizeNoInit(numPrim + 1);
+		UTparallelForLightItems(UT_BlockedRange<GA_Size>(0, numPrim), [this, &edgeStart](const UT_BlockedRange<GA_Size>& r)
+			{
+				for (GA_Size primId = r.begin(); primId != r.end(); ++primId)
+				{
+					GA_Size numVertex = _pGeom->getPrimitiveVertexCount(_pGeom->primitiveOffset(primId));
+					edgeStart[primId] = numVertex >= 3 ? numVertex : 0;
+				}
+			});
+		exint numEdge = 0;
+		for (GA_Size primId = 0; primId < numPrim; ++primId)
+		{
+			exint count = edgeStart[primId];
+			edgeStart[primId] = numEdge;
+			numEdge += count;
+		}
+		edgeStart[numPrim] = numEdge;
+		_edges.setSizeNoInit(numEdge);
+		UTparallelForLightItems(UT_BlockedRange<GA_Size>(0, numPrim), [this, &edgeStart](const UT_BlockedRange<GA_Size>& r)
+			{
+				for (GA_Size primId = r.begin(); primId != r.end(); ++primId)
+				{
+					GA_Offset primOff = _pGeom->primitiveOffset(primId);
+					exint numVertex = edgeStart[primId + 1] - edgeStart[primId];
+					for (exint i = 0; i < numVertex; ++i)
+					{
+						GA_Index a = _pGeom->pointIndex(_pGeom->vertexPoint(_pGeom->getPrimitiveVertexOffset(primOff, i)));
+						GA_Index b = _pGeom->pointIndex(_pGeom->vertexPoint(_pGeom->getPrimitiveVertexOffset(primOff, (i + 1) % numVertex)));
+						_edges[edgeStart[primId] + i] = EdgeKey(a, b);
+					}
+				}
+			});
+		UTparallelSort(_edges.begin(), _edges.end());
+		_edges.setSize(std::unique(_edges.begin(), _edges.end()) - _edges.begin());
+	}
+	exint FindEdge(uint64 key) const
+	{
+		auto it = std::lower_bound(_edges.begin(), _edges.end(), key);
+		UT_ASSERT(it != _edges.end() && *it == key);
+		return it - _edges.begin();
+	}
+	void TestPoints(UT_ThreadSpecificValue<VisibilityTestLocalStorage>& localStorage)
+	{
+		const GA_Size numPoint = _pGeom->getNumPoints();
+		_pointNormals.setSizeNoInit(numPoint);
+		_pointBits.Initialize(numPoint);
+		UTparallelFor(UT_BlockedRange<GA_Size>(0, numPoint, 64), [this, &localStorage](const UT_BlockedRange<GA_Size>& r)
+			{
+				VisibilityTestLocalStorage& local = localStorage.get();
+				for (GA_Size ptIdx = r.begin(); ptIdx != r.end(); ++ptIdx)
+				{
+					GA_Offset ptOff = _pGeom->pointOffset(ptIdx);
+					UT_Vector3 normal = _pGenerator->GetPointNormal(ptOff);
+					_pointNormals[ptIdx] = normal;
+					// points not used by any primitive have no hemisphere to sample
+					if (normal.length2() == 0)
+					{
+						continue;
+					}
+					int numRay = 0;
+					int numEscaped = 0;
+					local.packets.clear();
+					_pGenerator->GenerateSharedSampleRays(ptIdx, _pGeom->getPos3(ptOff), normal, local.packets);
+					TraceRayPackets(*_pAS, _pointBits, ptIdx, local.packets, _pRayLog, numRay, numEscaped);
+				}
+			});
+	}
+	void TestEdges(UT_ThreadSpecificValue<VisibilityTestLocalStorage>& localStorage)
+	{
+		_edgeBits.Initialize(_edges.size());
+		if (_edgeSampleCount == 0)
+		{
+			return;
+		}
+		UTparallelFor(UT_BlockedRange<exint>(0, _edges.size(), 64), [this, &localStorage](const UT_BlockedRange<exint>& r)
+			{
+				VisibilityTestLocalStorage& local = localStorage.get();
+				for (exint e = r.begin(); e != r.end(); ++e)
+				{
+					GA_Index a = GA_Index(_edges[e] >> 32);
+					GA_Index b = GA_Index(_edges[e] & 0xFFFFFFFF);
+					// an edge whose end point is visible makes its primitives visible anyway
+					if (_pointBits.Test(a) || _pointBits.Test(b))
+					{
+						continue;
+					}
+					UT_Vector3 pa = _pGeom->getPos3(_pGeom->pointOffset(a));
+					UT_Vector3 pb = _pGeom->getPos3(_pGeom->pointOffset(b));
+					UT_Vector3 normal = _pointNormals[a] + _pointNormals[b];
+					normal.normalize();
+					local.packets.clear();
+					for (int k = 0; k < _edgeSampleCount; ++k)
+					{
+						float t = (k + 1) / float(_edgeSampleCount + 1);
+						_pGenerator->GenerateSharedSampleRays(e, pa + (pb - pa) * t, normal, local.packets);
+					}
+					int numRay = 0;
+					int numEscaped = 0;
+					TraceRayPackets(*_pAS, _edgeBits, e, local.packets, _pRayLog, numRay, numEscaped);
+				}
+			});
+	}
+	/// <summary>
+	/// test the shared samples and OR them into the visibility of the primitives using them.
+	/// </summary>
+	void Run(VisibilityBitset& primBits, UT_ThreadSpecificValue<VisibilityTestLocalStorage>& localStorage)
+	{
+		CollectEdges();
+		TestPoints(localStorage);
+		TestEdges(localStorage);
+		const GA_Size numPrim = _pGeom->getNumPrimitives();
+		UTparallelForLightItems(UT_BlockedRange<GA_Size>(0, numPrim), [this, &primBits](const UT_BlockedRange<GA_Size>& r)
+			{
+				for (GA_Size primId = r.begin(); primId != r.end(); ++primId)
+				{
+					GA_Offset primOff = _pGeom->primitiveOffset(primId);
+					GA_Size numVertex = _pGeom->getPrimitiveVertexCount(primOff);
+					if (numVertex < 3)
+					{
+						continue;
+					}
+					for (GA_Size i = 0; i < numVertex; ++i)
+					{
+						GA_Index a = _pGeom->pointIndex(_pGeom->vertexPoint(_pGeom->getPrimitiveVertexOffset(primOff, i)));
+						GA_Index b = _pGeom->pointIndex(_pGeom->vertexPoint(_pGeom->getPrimitiveVertexOffset(primOff, (i + 1) % numVertex)));
+						if (_pointBits.Test(a) || _edgeBits.Test(FindEdge(EdgeKey(a, b))))
+						{
+							primBits.Set(primId);
+							break;
+						}
+					}
+				}
+			});
+	}
+	bool IsPointVisible(GA_Index ptIdx) const
+	{
+		return _pointBits.Test(ptIdx);
+	}
+};
 
-	~VisibilityMarker(){}
-	void operator()(Ray* ray) const
+/// <summary>
+/// viewpoints method: renders every viewpoint into a cube map of primary rays,
+/// and marks the occludee primitive seen by every pixel visible.
+/// the cost scales with viewpoints x resolution, not with the number of occludee primitives.
+/// </summary>
+class ViewpointVisibilityOperator
+{
+private:
+	RayTracingAccelerationStructure* _pAS;
+	const UT_Array<UT_Vector3>* _pViewpoints;
+	int _resolution;
+	VisibilityBitset* _pVisibleBits;
+public:
+	static constexpr int kNumFace = 6;
+	ViewpointVisibilityOperator(RayTracingAccelerationStructure& as, const UT_Array<UT_Vector3>& viewpoints, int resolution, VisibilityBitset& visibleBits)
+		:
+		_pAS(&as),
+		_pViewpoints(&viewpoints),
+		_resolution(resolution),
+		_pVisibleBits(&visibleBits)
+	{}
+	/// <summary>
+	/// direction of the pixel centre (x, y) on a cube face.
+	/// </summary>
+	UT_Vector3 PixelDirection(int face, int x, int y) const
+	{
+		// major axis, then the axes of u and v on the face
+		static const float kFaceAxes[kNumFace][3][3] = {
+			{ {  1, 0, 0 }, { 0, 0, -1 }, { 0, -1, 0 } },
+			{ { -1, 0, 0 }, { 0, 0,  1 }, { 0, -1, 0 } },
+			{ { 0,  1, 0 }, { 1, 0,  0 }, { 0, 0,  1 } },
+			{ { 0, -1, 0 }, { 1, 0,  0 }, { 0, 0, -1 } },
+			{ { 0, 0,  1 }, {  1, 0, 0 }, { 0, -1, 0 } },
+			{ { 0, 0, -1 }, { -1, 0, 0 }, { 0, -1, 0 } },
+		};
+		const float (&axes)[3][3] = kFaceAxes[face];
+		float u = 2 * (x + 0.5f) / _resolution - 1;
+		float v = 2 * (y + 0.5f) / _resolution - 1;
+		UT_Vector3 dir(
+			axes[0][0] + u * axes[1][0] + v * axes[2][0],
+			axes[0][1] + u * axes[1][1] + v * axes[2][1],
+			axes[0][2] + u * axes[1][2] + v * axes[2][2]);
+		dir.normalize();
+		return dir;
+	}
+	/// <summary>
+	/// range over rows of all faces of all viewpoints, row = (viewpoint * kNumFace + face) * resolution + y.
+	/// </summary>
+	void operator()(const UT_BlockedRange<exint>& range) const
 	{
-		if (_visibilityOfPrim->size() < ray->primId + 1 && ray->primId >= 0)
+		float ox[RayPacket::kMaxSize], oy[RayPacket::kMaxSize], oz[RayPacket::kMaxSize];
+		float dx[RayPacket::kMaxSize], dy[RayPacket::kMaxSize], dz[RayPacket::kMaxSize];
+		RayHit hits[RayPacket::kMaxSize];
+		for (exint row = range.begin(); row != range.end(); ++row)
 		{
-			// Implementation note: in best practice, user should pre-allocate enough space to store result. But if user don't, we resize it to make sure all the results are stored.
-			int currentSize = _visibilityOfPrim->size();
-			_visibilityOfPrim->setCapacity(ray->primId + 1);
-			_visibilityOfPrim->setSize(ray->primId + 1);
+			int y = int(row % _resolution);
+			int face = int((row / _resolution) % kNumFace);
+			const UT_Vector3& origin = (*_pViewpoints)[row / (_resolution * kNumFace)];
+			// neighbouring pixels of a row make a coherent packet
+			for (int x0 = 0; x0 < _resolution; x0 += RayPacket::kMaxSize)
+			{
+				int numRay = SYSmin(RayPacket::kMaxSize, _resolution - x0);
+				for (int i = 0; i < numRay; ++i)
+				{
+					UT_Vector3 dir = PixelDirection(face, x0 + i, y);
+					ox[i] = origin.x();
+					oy[i] = origin.y();
+					oz[i] = origin.z();
+					dx[i] = dir.x();
+					dy[i] = dir.y();
+					dz[i] = dir.z();
+				}
+				_pAS->QueryRayHit8(numRay, ox, oy, oz, dx, dy, dz,
+					0, std::numeric_limits<float>::infinity(), hits);
+				for (int i = 0; i < numRay; ++i)
+				{
+					// the occludee is the visible area of this scene
+					if (hits[i].isVisible)
+					{
+						_pVisibleBits->Set(_pAS->GetVisibleAreaPrim(hits[i].hitPrim));
+					}
+				}
+			}
 		}
-		(*_visibilityOfPrim)[ray->primId] = (*_visibilityOfPrim)[ray->primId] || ray->visible;
+	}
+};
 
-#ifdef _DEBUG
-		if (_rayOrigin != nullptr && _rayDir != nullptr)
+/// <summary>
+/// reverse method: the sample rays start on the visible area, on both sides of every triangle,
+/// pass through the occludee until they hit the occluder or escape, and mark the occludee primitives they reach from the front visible.
+/// the cost scales with the visible area instead of the occludee, which pays off when the visible area is the smaller one.
+/// </summary>
+class ReverseVisibilityOperator
+{
+private:
+	const RayGenerator* _pGenerator;
+	RayTracingAccelerationStructure* _pAS;
+	VisibilityBitset* _pVisibleBits;
+	UT_ThreadSpecificValue<VisibilityTestLocalStorage>* _pLocalStorage;
+public:
+	ReverseVisibilityOperator(
+		const RayGenerator& generator,
+		RayTracingAccelerationStructure& as,
+		VisibilityBitset& visibleBits,
+		UT_ThreadSpecificValue<VisibilityTestLocalStorage>& localStorage)
+		:
+		_pGenerator(&generator),
+		_pAS(&as),
+		_pVisibleBits(&visibleBits),
+		_pLocalStorage(&localStorage)
+	{}
+	// a ray passes through at most this many occludee surfaces before it's dropped
+	static constexpr int kMaxLayers = 64;
+	/// <summary>
+	/// trace packet through the occludee until every ray hit the occluder or escaped, and mark the occludee primitives on the way
+	/// whose front faces the ray. this is the question of the hemisphere method asked backwards: the occludee doesn't occlude itself,
+	/// and a primitive is only visible from its front hemisphere, through a segment to the visible area free of occluder.
+	/// </summary>
+	void TracePacket(RayPacket& packet) const
+	{
+		// the rays keep their origin, each layer starts a few ulps past the previous hit,
+		// so the gap that could hide a thin occluder stays proportional to the float precision of the hit distance
+		float nears[RayPacket::kMaxSize] = {};
+		for (int layer = 0; layer < kMaxLayers && packet.size > 0; ++layer)
 		{
-			(*_rayOrigin).append(UT_Vector3(ray->ox, ray->oy, ray->oz));
-			(*_rayDir).append(UT_Vector3(ray->dx, ray->dy, ray->dz));
+			// the hit primitive is needed, so it's always the full hit query
+			_pAS->QueryRayHit8(packet.size,
+				packet.ox, packet.oy, packet.oz,
+				packet.dx, packet.dy, packet.dz,
+				0, std::numeric_limits<float>::infinity(), packet.hits, nears);
+			int numContinued = 0;
+			for (int i = 0; i < packet.size; ++i)
+			{
+				// the occludee is the visible area of this scene
+				if (!packet.hits[i].isVisible)
+				{
+					continue;
+				}
+				// the hemisphere rays leave along the houdini normal, so a reverse ray arrives from the front against it.
+				// embree's normal is flipped, hence the positive sign. back hits are passed through without marking
+				if (dot(UT_Vector3(packet.dx[i], packet.dy[i], packet.dz[i]), packet.hits[i].hitNormal) > 0)
+				{
+					_pVisibleBits->Set(_pAS->GetVisibleAreaPrim(packet.hits[i].hitPrim));
+				}
+				nears[numContinued] = packet.hits[i].hitDistance * (1 + 4 * std::numeric_limits<float>::epsilon());
+				packet.ox[numContinued] = packet.ox[i];
+				packet.oy[numContinued] = packet.oy[i];
+				packet.oz[numContinued] = packet.oz[i];
+				packet.dx[numContinued] = packet.dx[i];
+				packet.dy[numContinued] = packet.dy[i];
+				packet.dz[numContinued] = packet.dz[i];
+				++numContinued;
+			}
+			packet.size = numContinued;
 		}
-		if (_hitPrim != nullptr && _hitUV != nullptr && _hitVisible != nullptr && _hitPos != nullptr)
+	}
+	/// <summary>
+	/// range over the primitives of the visible area.
+	/// </summary>
+	void operator()(const UT_BlockedRange<int>& range) const
+	{
+		UT_Array<RayPacket>& packets = _pLocalStorage->get().packets;
+		for (int primId = range.begin(); primId != range.end(); ++primId)
 		{
-			(*_hitPrim).append(ray->hitPrim);
-			(*_hitUV).append(UT_Vector2(ray->hitU, ray->hitV));
-			(*_hitVisible).append(ray->visible);
-			(*_hitPos).append(ray->hitPos);
+			packets.clear();
+			for (exint t = _pGenerator->GetFirstTriangle(primId); t < _pGenerator->GetTriangleEnd(primId); ++t)
+			{
+				SampleTriangle triangle = _pGenerator->GetSampleTriangle(t);
+				for (int side = 0; side < 2; ++side)
+				{
+					_pGenerator->GenerateFixedSampleRays(primId, triangle, packets);
+					_pGenerator->GenerateRandomSampleRays(primId, triangle, 0, _pGenerator->GetNumRandomSampleCount(), packets);
+					// the other side: the flipped frame is still orthonormal
+					triangle.normal = -triangle.normal;
+					triangle.binormal = -triangle.binormal;
+				}
+			}
+			for (exint p = 0; p < packets.size(); ++p)
+			{
+				TracePacket(packets(p));
+			}
 		}
-#endif
 	}
 };
 
+/// <summary>
+/// number of fan triangles of the primitives of geom, the samplers emit the same samples for every triangle whatever its area.
+/// </summary>
+static exint CountTriangles(const GA_Detail& geom)
+{
+	exint numTriangle = 0;
+	GA_Offset primOff;
+	GA_FOR_ALL_PRIMOFF(&geom, primOff)
+	{
+		numTriangle += SYSmax(exint(geom.getPrimitiveVertexCount(primOff)) - 2, exint(0));
+	}
+	return numTriangle;
+}
+
 class SOP_OcclusionRemoverVerb : public SOP_NodeVerb
 {
 public:
@@ -922,6 +2995,17 @@ const SOP_NodeVerb* SOP_OcclusionRemover::cookVerb() const
     return SOP_OcclusionRemoverVerb::theVerb.get();
 }
 
+void SOP_OcclusionRemover::getNodeSpecificInfoText(OP_Context& context, OP_NodeInfoParms& iparms)
+{
+    SOP_Node::getNodeSpecificInfoText(context, iparms);
+    const SOP_OcclusionRemoverCache* sopCache = static_cast<const SOP_OcclusionRemoverCache*>(myNodeVerbCache);
+    if (sopCache != nullptr && sopCache->GetSceneInfo().isstring())
+    {
+        iparms.append(sopCache->GetSceneInfo().c_str());
+        iparms.append("\n");
+    }
+}
+
 const char* const SOP_OcclusionRemoverVerb::theDsFile = R"THEDSFILE(
     {
         name occlusionremover
@@ -944,10 +3028,148 @@ const char* const SOP_OcclusionRemoverVerb::theDsFile = R"THEDSFILE(
 		default { 10 }
 		}
 		parm {
-		name "parallelism"
-		label "Parallelism"
+		name "adaptive"
+		label "Adaptive Sampling"
+		type toggle
+		default { "0" }
+		disablewhen "{ samplemode == point } { progressive == 1 }"
+		}
+		parm {
+		name "maxsamplepoints"
+		label "Max Sample Points"
+		type integer
+		default { 64 }
+		range { 1! 1024 }
+		disablewhen "{ adaptive == 0 } { samplemode == point } { progressive == 1 }"
+		}
+		parm {
+		name "method"
+		label "Method"
+		type ordinal
+		default { "hemisphere" }
+		menu {
+			"hemisphere"	"Hemisphere Rays to Visible Area"
+			"viewpoints"	"Seen from Viewpoints"
+			"reverse"	"Rays from Visible Area"
+			"auto"		"Automatic by Sample Count"
+		}
+		}
+		parm {
+		name "cuberesolution"
+		label "Cube Map Resolution"
+		type integer
+		default { 256 }
+		range { 1! 2048 }
+		hidewhen "{ method != viewpoints }"
+		}
+		parm {
+		name "samplemode"
+		label "Sample Mode"
+		type ordinal
+		default { "triangle" }
+		menu {
+			"triangle"	"Per Triangle"
+			"point"		"Shared Points and Edges"
+		}
+		}
+		parm {
+		name "edgesamples"
+		label "Samples per Edge"
+		type integer
+		default { 1 }
+		range { 0! 8 }
+		hidewhen "{ samplemode == triangle }"
+		}
+		parm {
+		name "pointattribname"
+		label "Point Attribute Name"
+		type string
+		default { "point_visibility" }
+		hidewhen "{ samplemode == triangle }"
+		}
+		parm {
+		name "progressive"
+		label "Progressive Refinement"
+		type toggle
+		default { "0" }
+		disablewhen "{ method == viewpoints } { method == reverse } { samplemode == point }"
+		}
+		parm {
+		name "numpasses"
+		label "Passes"
 		type integer
-		default { 16 }
+		default { 3 }
+		range { 1! 16! }
+		disablewhen "{ progressive == 0 } { method == viewpoints } { method == reverse } { samplemode == point }"
+		}
+		parm {
+		name "tolerance"
+		label "Settle Tolerance"
+		type float
+		default { 0.05 }
+		range { 0! 0.5 }
+		disablewhen "{ progressive == 0 } { method == viewpoints } { method == reverse } { samplemode == point }"
+		}
+		parm {
+		name "fractionattribname"
+		label "Visible Fraction Attribute"
+		type string
+		default { "visible_fraction" }
+		disablewhen "{ progressive == 0 } { method == viewpoints } { method == reverse } { samplemode == point }"
+		}
+		parm {
+		name "raycountattribname"
+		label "Ray Count Attribute"
+		type string
+		default { "ray_count" }
+		disablewhen "{ progressive == 0 } { method == viewpoints } { method == reverse } { samplemode == point }"
+		}
+		parm {
+		name "buildquality"
+		label "BVH Build Quality"
+		type ordinal
+		default { "medium" }
+		menu {
+			"low"		"Low (Fast Build)"
+			"medium"	"Medium"
+			"high"		"High (Fast Trace)"
+		}
+		}
+		parm {
+		name "compact"
+		label "Compact BVH"
+		type toggle
+		default { "0" }
+		}
+		parm {
+		name "raylog"
+		label "Ray Log"
+		type toggle
+		default { "0" }
+		disablewhen "{ method == viewpoints } { method == reverse }"
+		}
+		parm {
+		name "raylogfraction"
+		label "Logged Fraction"
+		type float
+		default { 0.01 }
+		range { 0! 1! }
+		disablewhen "{ raylog == 0 } { method == viewpoints } { method == reverse } { raylogprims != \"\" }"
+		}
+		parm {
+		name "raylogprims"
+		label "Logged Primitives"
+		type string
+		default { "" }
+		disablewhen "{ raylog == 0 } { method == viewpoints } { method == reverse } { samplemode == point }"
+		}
+		parm {
+		name "raylogsize"
+		label "Max Logged Rays"
+		type integer
+		default { 10000 }
+		range { 1! 1000000 }
+		disablewhen "{ raylog == 0 } { method == viewpoints } { method == reverse }"
 		}
     })THEDSFILE";
 
@@ -958,56 +3180,205 @@ void SOP_OcclusionRemoverVerb::cook(const CookParms& cookparms) const
 	GEO_Detail* const occludee = cookparms.gdh().gdpNC();
 	const GEO_Detail* const occluder = cookparms.hasInput(1) ? cookparms.inputGeo(1) : nullptr;
 	const GEO_Detail* const visibleArea = cookparms.hasInput(2) ? cookparms.inputGeo(2) : nullptr;
-	sopCache->EnsureCache(*occluder, *visibleArea);
-	
-	GA_RWHandleV3 normalAttr = occludee->findFloatTuple(GA_ATTRIB_PRIMITIVE, "Normal");
-	//if (!normalAttr.isValid())
-	//{
-	//	normalAttr.bind(occludee->addFloatTuple(GA_ATTRIB_PRIMITIVE, "Normal", 3));
-	//}
-	if (!normalAttr.isValid())
-	{
-		// SOP user should add normal to occludee
-		cookparms.sopAddError(SOP_ATTRIBUTE_INVALID, "Normal");
-		return;
+	const int numPrim = occludee->getNumPrimitives();
+	VisibilityBitset visibleBits;
+	visibleBits.Initialize(numPrim);
+	UT_ThreadSpecificValue<VisibilityTestLocalStorage> localStorage;
+	int method = sopParms.getMethod();
+	if (method == SOP_OcclusionRemoverParms::kMethodAuto)
+	{
+		// rays start from the side with fewer samples: one set per occludee triangle,
+		// against one set per side of every visible area triangle.
+		// both methods answer the same question, the reverse rays pass through the occludee
+		method = 2 * CountTriangles(*visibleArea) < CountTriangles(*occludee)
+			? SOP_OcclusionRemoverParms::kMethodReverse
+			: SOP_OcclusionRemoverParms::kMethodHemisphere;
+		if (method == SOP_OcclusionRemoverParms::kMethodReverse && (sopParms.getRayLog() || sopParms.getProgressive()))
+		{
+			cookparms.sopAddWarning(SOP_MESSAGE, "Automatic picked the reverse method, the ray log and progressive passes are ignored");
+		}
+	}
+	// the progressive mode refines the per triangle samples of the hemisphere method
+	const bool progressive = sopParms.getProgressive()
+		&& method == SOP_OcclusionRemoverParms::kMethodHemisphere
+		&& sopParms.getSampleMode() == SOP_OcclusionRemoverParms::kSampleModeTriangle;
+	ProgressiveResults progressiveResults;
+	SceneBuildSettings buildSettings;
+	buildSettings.quality = SYSclamp(sopParms.getBuildQuality(), SceneBuildSettings::kQualityLow, SceneBuildSettings::kQualityHigh);
+	buildSettings.compact = sopParms.getCompactBVH();
+	RayTracingAccelerationStructure* pAS;
+	const SceneKey* pSceneKey;
+	RayLog rayLog;
+	RayLog* pRayLog = nullptr;
+	SYS_HashType rayLogKey = 0;
+	UT_BitArray rayLogSelection;
+	GOP_Manager rayLogGroupManager;
+	if (method == SOP_OcclusionRemoverParms::kMethodViewpoints)
+	{
+		// the points of the third input are the viewpoints, and the occludee occludes itself
+		sopCache->EnsureViewCache(*occluder, *occludee, buildSettings);
+		pAS = &sopCache->GetViewAccelerationStructureRef();
+		pSceneKey = &sopCache->GetViewSceneKey();
+		UT_Array<UT_Vector3> viewpoints;
+		viewpoints.setCapacity(visibleArea->getNumPoints());
+		GA_Offset ptOff;
+		GA_FOR_ALL_PTOFF(visibleArea, ptOff)
+		{
+			viewpoints.append(visibleArea->getPos3(ptOff));
+		}
+		const int resolution = SYSmax(sopParms.getCubeResolution(), 1);
+		UTparallelFor(
+			UT_BlockedRange<exint>(0, exint(viewpoints.size()) * ViewpointVisibilityOperator::kNumFace * resolution, 16),
+			ViewpointVisibilityOperator(sopCache->GetViewAccelerationStructureRef(), viewpoints, resolution, visibleBits)
+		);
+	}
+	else if (method == SOP_OcclusionRemoverParms::kMethodReverse)
+	{
+		// same scene as the viewpoints method, the rays start on the visible area and pass through the occludee
+		sopCache->EnsureViewCache(*occluder, *occludee, buildSettings);
+		pAS = &sopCache->GetViewAccelerationStructureRef();
+		pSceneKey = &sopCache->GetViewSceneKey();
+		RaySampleTables& sampleTables = sopCache->GetSampleTablesRef();
+		sampleTables.Ensure(sopParms.getNumRay(), sopParms.getNumRandomSampleForEachPrimitive());
+		RayGenerator generator(*visibleArea, sampleTables, sopParms.getNumRandomSampleForEachPrimitive());
+		generator.BuildSampleTriangles();
+		UTparallelFor(
+			UT_BlockedRange<int>(0, visibleArea->getNumPrimitives(), 16),
+			ReverseVisibilityOperator(generator, *pAS, visibleBits, localStorage)
+		);
 	}
-	//occludee->normal(normalAttr);
+	else
+	{
+		sopCache->EnsureCache(*occluder, *visibleArea, buildSettings);
+		pAS = &sopCache->GetRayTracingAccelerationStructureRef();
+		pSceneKey = &sopCache->GetSceneKey();
+
+		AdaptiveSamplingSettings adaptive;
+		adaptive.enabled = sopParms.getAdaptiveSampling();
+		adaptive.maxSamplePoints = sopParms.getMaxSamplePoints();
+		RaySampleTables& sampleTables = sopCache->GetSampleTablesRef();
+		sampleTables.Ensure(sopParms.getNumRay(),
+			adaptive.enabled ? SYSmax(sopParms.getNumRandomSampleForEachPrimitive(), adaptive.maxSamplePoints) : sopParms.getNumRandomSampleForEachPrimitive());
+		// the generator state belongs to this cook, so concurrent cooks of several nodes don't share anything
+		RayGenerator generator(*occludee, sampleTables, sopParms.getNumRandomSampleForEachPrimitive());
+		if (sopParms.getSampleMode() == SOP_OcclusionRemoverParms::kSampleModeTriangle)
+		{
+			generator.BuildSampleTriangles();
+		}
+		if (sopParms.getRayLog())
+		{
+			// the selection is a primitive group, it only applies to per triangle samples,
+			// the rays of shared samples belong to points and edges
+			const GA_PrimitiveGroup* logGroup = nullptr;
+			if (sopParms.getRayLogPrims().isstring() && sopParms.getSampleMode() == SOP_OcclusionRemoverParms::kSampleModeTriangle)
+			{
+				bool success;
+				logGroup = rayLogGroupManager.parsePrimitiveDetached(sopParms.getRayLogPrims(), occludee, true, success);
+				if (!success)
+				{
+					cookparms.sopAddWarning(SOP_ERR_BADGROUP, sopParms.getRayLogPrims());
+				}
+			}
+			if (logGroup != nullptr)
+			{
+				rayLogSelection.resize(numPrim);
+				GA_Offset primOff;
+				GA_FOR_ALL_GROUP_PRIMOFF(occludee, logGroup, primOff)
+				{
+					rayLogSelection.setBitFast(occludee->primitiveIndex(primOff), true);
+				}
+			}
+			rayLog.Initialize(SYSmax(sopParms.getRayLogSize(), 1), sopParms.getRayLogFraction(), logGroup != nullptr ? &rayLogSelection : nullptr);
+			pRayLog = &rayLog;
+			rayLogKey = 1;
+			SYShashCombine(rayLogKey, sopParms.getRayLogFraction());
+			SYShashCombine(rayLogKey, sopParms.getRayLogPrims().hash());
+		}
+		if (sopParms.getSampleMode() == SOP_OcclusionRemoverParms::kSampleModePoint)
+		{
+			SharedSampleVisibility sharedSamples(*occludee, generator, sopCache->GetRayTracingAccelerationStructureRef(), sopParms.getEdgeSampleCount(),
+				pRayLog);
+			sharedSamples.Run(visibleBits, localStorage);
 
-#if _DEBUG
-	UT_Array<UT_Vector3> rayOrigin;
-	UT_Array<UT_Vector3> rayDir;
-	UT_Array<bool> hitVisible;
-	UT_Array<int> hitPrim;
-	UT_Array<UT_Vector2> hitUV;
-	UT_Array<UT_Vector3> hitPos;
-#endif
+			GA_RWHandleI pointVisibilityAttrib(occludee->findIntTuple(GA_ATTRIB_POINT, sopParms.getPointAttrib()));
+			if (!pointVisibilityAttrib.isValid())
+			{
+				pointVisibilityAttrib.bind(occludee->addIntTuple(GA_ATTRIB_POINT, sopParms.getPointAttrib(), 1));
+			}
+			if (!pointVisibilityAttrib.isValid())
+			{
+				cookparms.sopAddError(SOP_ATTRIBUTE_INVALID, sopParms.getPointAttrib());
+				return;
+			}
+			for (GA_Size i = 0; i < occludee->getNumPoints(); ++i)
+			{
+				pointVisibilityAttrib.set(occludee->pointOffset(i), sharedSamples.IsPointVisible(i));
+			}
+			pointVisibilityAttrib.bumpDataId();
+		}
+		else if (progressive)
+		{
+			progressiveResults.Initialize(numPrim);
+			const int numPasses = SYSclamp(sopParms.getNumPasses(), 1, 16);
+			const int numRandomSample = SYSmax(sopParms.getNumRandomSampleForEachPrimitive(), 0);
+			int sampled = 0;
+			for (int pass = 0; pass < numPasses; ++pass)
+			{
+				int end = ProgressiveResults::SampleCountAfterPass(pass, numPasses, numRandomSample);
+				UTparallelFor(
+					UT_BlockedRange<int>(0, numPrim, 16),
+					ProgressiveVisibilityOperator(generator, sopCache->GetRayTracingAccelerationStructureRef(), progressiveResults,
+						localStorage, pass == 0, sampled, end - sampled, sopParms.getTolerance(), pRayLog)
+				);
+				sampled = end;
+			}
+			for (int i = 0; i < numPrim; ++i)
+			{
+				if (progressiveResults.numVisible[i] > 0)
+				{
+					visibleBits.Set(i);
+				}
+			}
+		}
+		else
+		{
+			int64 meanAreaKey = SOP_OcclusionRemoverCache::GetNoMeanAreaKey();
+			if (adaptive.enabled)
+			{
+				// quantised in steps of 1/64 octave, and the budgets use the quantised value,
+				// so cached results are reused only with the exact budgets they were traced with
+				double meanArea = generator.ComputeMeanTriangleArea();
+				if (meanArea > 0)
+				{
+					meanAreaKey = int64(SYSrint(std::log2(meanArea) * 64));
+					adaptive.meanTriangleArea = std::exp2(meanAreaKey / 64.0);
+				}
+			}
+			// only the primitives changed since the last cook are traced again
+			sopCache->EnsureOccludeeResults(numPrim, sopParms.getNumRay(), sopParms.getNumRandomSampleForEachPrimitive(),
+				adaptive.enabled ? adaptive.maxSamplePoints : -1, meanAreaKey, rayLogKey);
+			// a chunk of primitives is the unit of work, small enough to balance primitives with very different ray counts
+			UTparallelFor(
+				UT_BlockedRange<int>(0, numPrim, 16),
+				VisibilityTestOperator(generator, *sopCache, visibleBits, localStorage, adaptive, pRayLog)
+			);
+		}
+	}
 
-	UT_Array<bool> visibility;
-	visibility.setCapacity(occludee->getNumPrimitives());
-	visibility.setSize(occludee->getNumPrimitives());
-	for (int i = 0; i < occludee->getNumPrimitives(); ++i)
-	{
-		visibility[i] = false;
-	}
-	tbb::parallel_pipeline(
-		sopParms.getParallelism(),
-		tbb::make_filter<void, Ray*>(
-			tbb::filter::serial_in_order, RayGenerator(*occludee, sopParms.getNumRay(), sopParms.getNumRandomSampleForEachPrimitive())
-			)
-		&
-		tbb::make_filter<Ray*, Ray*>(
-			tbb::filter::parallel, VisibilityTestOperator(sopCache->GetRayTracingAccelerationStructureRef())
-			)
-		&
-		tbb::make_filter<Ray*, void>(
-			tbb::filter::serial_out_of_order, 
-#if _DEBUG
-			VisibilityMarker(visibility, &rayOrigin, &rayDir, &hitPrim, &hitUV, &hitVisible, &hitPos)
-#else
-			VisibilityMarker(visibility)
-#endif
-			)
-	);
+	{
+		// shown in the node info. the scene may be shared with other nodes,
+		// when this node reused it the build time is the one of whichever node built or refit it last
+		static const char* const actionNames[] = { "reused", "built", "refit" };
+		const SceneBuildSettings& settings = pAS->GetBuildSettings();
+		UT_WorkBuffer info;
+		info.sprintf("Scene %s by this node: %s quality%s, built in %.3f s, %.1f MB",
+			actionNames[sopCache->GetSceneAction()],
+			settings.GetQualityName(),
+			settings.compact ? ", compact" : "",
+			pAS->GetBuildTime(),
+			EmbreeSceneRegistry::Get().GetMemoryUsage(*pSceneKey) / (1024.0 * 1024.0));
+		sopCache->SetSceneInfo(UT_StringHolder(info));
+	}
 
 	GA_RWHandleI visibilityAttrib(occludee->findIntTuple(GA_ATTRIB_PRIMITIVE, sopParms.getAttrib()));
 	if (!visibilityAttrib.isValid())
@@ -1019,88 +3390,92 @@ void SOP_OcclusionRemoverVerb::cook(const CookParms& cookparms) const
 		cookparms.sopAddError(SOP_ATTRIBUTE_INVALID, sopParms.getAttrib());
 		return;
 	}
-	for (int i = 0; i < occludee->getNumPrimitives(); ++i)
+	for (int i = 0; i < numPrim; ++i)
 	{
 		auto offset = occludee->primitiveOffset(i);
-		visibilityAttrib.set(offset, visibility[i]);
-	}
-
-#ifdef _DEBUG
-	// In debug build, we can use following attributes to review hit results
-	auto block = occludee->appendPointBlock(rayOrigin.size());
-	GA_RWHandleV3 rayOriginAttr(occludee->findFloatTuple(GA_ATTRIB_POINT, "ro"));
-	if (!rayOriginAttr.isValid())
-	{
-		rayOriginAttr.bind(occludee->addFloatTuple(GA_ATTRIB_POINT, "ro", 3));
-	}
-	if (!rayOriginAttr.isValid())
-	{
-		cookparms.sopAddError(SOP_ATTRIBUTE_INVALID, sopParms.getAttrib());
-		return;
-	}
-	GA_RWHandleV3 rayDirAttr(occludee->findFloatTuple(GA_ATTRIB_POINT, "rd"));
-	if (!rayDirAttr.isValid())
-	{
-		rayDirAttr.bind(occludee->addFloatTuple(GA_ATTRIB_POINT, "rd", 3));
-	}
-	if (!rayDirAttr.isValid())
-	{
-		cookparms.sopAddError(SOP_ATTRIBUTE_INVALID, sopParms.getAttrib());
-		return;
-	}
-	GA_RWHandleI hitPrimAttr(occludee->findIntTuple(GA_ATTRIB_POINT, "hit_prim"));
-	if (!hitPrimAttr.isValid())
-	{
-		hitPrimAttr.bind(occludee->addIntTuple(GA_ATTRIB_POINT, "hit_prim", 1));
-	}
-	if (!hitPrimAttr.isValid())
-	{
-		cookparms.sopAddError(SOP_ATTRIBUTE_INVALID, sopParms.getAttrib());
-		return;
-	}
-	GA_RWHandleV2 hitUVAttr(occludee->findFloatTuple(GA_ATTRIB_POINT, "hit_uv"));
-	if (!hitUVAttr.isValid())
-	{
-		hitUVAttr.bind(occludee->addFloatTuple(GA_ATTRIB_POINT, "hit_uv", 2));
-	}
-	if (!hitUVAttr.isValid())
-	{
-		cookparms.sopAddError(SOP_ATTRIBUTE_INVALID, sopParms.getAttrib());
-		return;
-	}
-	GA_RWHandleI hitVisibleAttr(occludee->findIntTuple(GA_ATTRIB_POINT, "hit_visible"));
-	if (!hitVisibleAttr.isValid())
-	{
-		hitVisibleAttr.bind(occludee->addIntTuple(GA_ATTRIB_POINT, "hit_visible", 1));
-	}
-	if (!hitVisibleAttr.isValid())
-	{
-		cookparms.sopAddError(SOP_ATTRIBUTE_INVALID, sopParms.getAttrib());
-		return;
+		visibilityAttrib.set(offset, visibleBits.Test(i));
 	}
-	GA_RWHandleV3 hitPosAttr(occludee->findFloatTuple(GA_ATTRIB_POINT, "hit_pos"));
-	if (!hitPosAttr.isValid())
+	if (progressive)
 	{
-		hitPosAttr.bind(occludee->addFloatTuple(GA_ATTRIB_POINT, "hit_pos", 3));
+		GA_RWHandleF fractionAttrib(occludee->findFloatTuple(GA_ATTRIB_PRIMITIVE, sopParms.getFractionAttrib()));
+		if (!fractionAttrib.isValid())
+		{
+			fractionAttrib.bind(occludee->addFloatTuple(GA_ATTRIB_PRIMITIVE, sopParms.getFractionAttrib(), 1));
+		}
+		if (!fractionAttrib.isValid())
+		{
+			cookparms.sopAddError(SOP_ATTRIBUTE_INVALID, sopParms.getFractionAttrib());
+			return;
+		}
+		GA_RWHandleI rayCountAttrib(occludee->findIntTuple(GA_ATTRIB_PRIMITIVE, sopParms.getRayCountAttrib()));
+		if (!rayCountAttrib.isValid())
+		{
+			rayCountAttrib.bind(occludee->addIntTuple(GA_ATTRIB_PRIMITIVE, sopParms.getRayCountAttrib(), 1));
+		}
+		if (!rayCountAttrib.isValid())
+		{
+			cookparms.sopAddError(SOP_ATTRIBUTE_INVALID, sopParms.getRayCountAttrib());
+			return;
+		}
+		for (int i = 0; i < numPrim; ++i)
+		{
+			auto offset = occludee->primitiveOffset(i);
+			fractionAttrib.set(offset, progressiveResults.VisibleFraction(i));
+			rayCountAttrib.set(offset, progressiveResults.numRay[i]);
+		}
 	}
-	if (!hitPosAttr.isValid())
+
+	if (pRayLog != nullptr)
 	{
-		cookparms.sopAddError(SOP_ATTRIBUTE_INVALID, sopParms.getAttrib());
-		return;
+		pRayLog->Merge();
 	}
-	for (int i = 0; i < rayOrigin.size(); ++i)
+	if (pRayLog != nullptr && pRayLog->GetNumEntries() > 0)
 	{
-		auto offset = block + i;
-		rayOriginAttr.set(offset, rayOrigin[i]);
-		rayDirAttr.set(offset, rayDir[i]);
-		hitPrimAttr.set(offset, hitPrim[i]);
-		hitUVAttr.set(offset, hitUV[i]);
-		hitVisibleAttr.set(offset, hitVisible[i]);
-		hitPosAttr.set(offset, hitPos[i]);
+		// every logged ray is an open polyline from its origin to its hit, escaped rays are drawn as long as the occludee's bounds
+		UT_BoundingBox bbox;
+		occludee->getBBox(&bbox);
+		const float escapeLength = SYSmax(bbox.getRadius() * 2, 1.0f);
+		const exint numLogged = pRayLog->GetNumEntries();
+		GA_Offset ptStart = occludee->appendPointBlock(numLogged * 2);
+		UT_Array<int> pointNumbers;
+		pointNumbers.setSizeNoInit(numLogged * 2);
+		for (exint i = 0; i < numLogged; ++i)
+		{
+			const RayLog::Entry& entry = pRayLog->GetEntry(i);
+			occludee->setPos3(ptStart + i * 2, entry.origin);
+			occludee->setPos3(ptStart + i * 2 + 1, entry.status == RayLog::kEscaped ? entry.origin + entry.dir * escapeLength : entry.hitPos);
+			pointNumbers[i * 2] = int(i * 2);
+			pointNumbers[i * 2 + 1] = int(i * 2 + 1);
+		}
+		GA_PolyCounts polyCounts;
+		polyCounts.append(2, numLogged);
+		GA_Offset primStart = GEO_PrimPoly::buildBlock(occludee, ptStart, numLogged * 2, polyCounts, pointNumbers.data(), false);
+		GA_PrimitiveGroup* logGroup = occludee->findPrimitiveGroup("raylog");
+		if (logGroup == nullptr)
+		{
+			logGroup = occludee->newPrimitiveGroup("raylog");
+		}
+		GA_RWHandleI sourceAttrib(occludee->addIntTuple(GA_ATTRIB_PRIMITIVE, "raylog_source", 1));
+		GA_RWHandleI statusAttrib(occludee->addIntTuple(GA_ATTRIB_PRIMITIVE, "raylog_status", 1));
+		GA_RWHandleI hitPrimAttrib(occludee->addIntTuple(GA_ATTRIB_PRIMITIVE, "raylog_hitprim", 1));
+		GA_RWHandleI hitInputAttrib(occludee->addIntTuple(GA_ATTRIB_PRIMITIVE, "raylog_hitinput", 1));
+		if (!sourceAttrib.isValid() || !statusAttrib.isValid() || !hitPrimAttrib.isValid() || !hitInputAttrib.isValid())
+		{
+			cookparms.sopAddError(SOP_ATTRIBUTE_INVALID, "raylog");
+			return;
+		}
+		for (exint i = 0; i < numLogged; ++i)
+		{
+			const RayLog::Entry& entry = pRayLog->GetEntry(i);
+			GA_Offset primOff = primStart + i;
+			sourceAttrib.set(primOff, entry.sourceId);
+			statusAttrib.set(primOff, entry.status);
+			hitPrimAttrib.set(primOff, entry.hitPrim);
+			hitInputAttrib.set(primOff, entry.hitInput);
+			logGroup->addOffset(primOff);
+		}
+		occludee->bumpDataIdsForAddOrRemove(true, true, true);
 	}
-#endif
-	//normalAttr.clear();
-	//occludee->destroyAttribute(GA_ATTRIB_PRIMITIVE, "Normal");
 }
 
 void newSopOperator(OP_OperatorTable* table)
@@ -0,0 +1,424 @@
+#include "MarchingSquare.h"
+#include <mutex>
+#include <tbb/parallel_for.h>
+namespace Geometry
+{
+	namespace
+	{
+		// Cells are hashed with 31 bits per axis, and edges with one more bit
+		// for the axis, so the bound is much larger than MarchingCube's and
+		// the domain never has to be split.
+		const int kBoundLimit = (1 << 30) - 2;
+		const int kContinuousCellNumLimit = 64;
+		const int kRootFindStepNum = 6;
+		const UT_Vector2I kNeighbourCellDirection[] = {
+			UT_Vector2I(-1, 0),
+			UT_Vector2I(1, 0),
+			UT_Vector2I(0, -1),
+			UT_Vector2I(0, 1)
+		};
+		const int kNeighbourCellDirectionArrLength = 4;
+		// Counter-clockwise, so that edge i goes from corner i to corner i + 1.
+		const UT_Vector2I kCellCornerOffset[] = {
+			UT_Vector2I(0, 0),
+			UT_Vector2I(1, 0),
+			UT_Vector2I(1, 1),
+			UT_Vector2I(0, 1)
+		};
+		const int kCellCornerNum = 4;
+
+		UT_Vector2I ToCell(const UT_Vector2D& position, double resolution)
+		{
+			return UT_Vector2I(
+				(int)std::floor(position.x() / resolution),
+				(int)std::floor(position.y() / resolution)
+			);
+		}
+
+		UT_Vector2D ToPosition(const UT_Vector2I& cell, double resolution)
+		{
+			return UT_Vector2D(
+				(double)cell.x() * resolution,
+				(double)cell.y() * resolution
+			);
+		}
+
+		Int64 CellHash(const UT_Vector2I& cell)
+		{
+			return (((Int64)cell.x() & 0x7FFFFFFF) << 31) | ((Int64)cell.y() & 0x7FFFFFFF);
+		}
+
+		Int64 EdgeHash(const UT_Vector2I& a, const UT_Vector2I& b)
+		{
+			UT_Vector2I diff = b - a;
+			const UT_Vector2I& origin = (diff.x() < 0 || diff.y() < 0) ? b : a;
+			return (CellHash(origin) << 1) | (diff.y() != 0 ? 1 : 0);
+		}
+
+		bool InBound(const UT_Vector2I& cell, const UT_Vector2I& bound)
+		{
+			return cell.x() >= 0 && cell.y() >= 0 && cell.x() <= bound.x() && cell.y() <= bound.y();
+		}
+	}
+
+	bool MarchingSquare::TrySetCellActive(const UT_Vector2I& cell)
+	{
+		auto cellHash = CellHash(cell);
+		int section = cellHash % kCellSectionNum;
+		std::lock_guard visitedLock(_visitedCellSectionMutex[section]);
+		return _visitedCellSections[section].insert(cellHash).second;
+	}
+
+	double MarchingSquare::CornerValue(const UT_Vector2I& corner, double resolution, const UT_Vector2D& fieldOffset)
+	{
+		auto cornerHash = CellHash(corner);
+		int section = cornerHash % kCornerSectionNum;
+		{
+			std::lock_guard cornerLock(_cornerValueSectionMutex[section]);
+			auto it = _cornerValueSections[section].find(cornerHash);
+			if (it != _cornerValueSections[section].end())
+			{
+				return it->second;
+			}
+		}
+		// Evaluated outside of the lock, since it's by far the most expensive
+		// part; if two threads race on the same corner, they compute the same value.
+		UT_Vector2D pos = ToPosition(corner, resolution) - fieldOffset;
+		double value = implicit(pos.x(), pos.y());
+		std::lock_guard cornerLock(_cornerValueSectionMutex[section]);
+		_cornerValueSections[section].emplace(cornerHash, value);
+		return value;
+	}
+
+	int MarchingSquare::CalcCornerSignBitmap(const UT_Vector2I& cell, double resolution, double isovalue, const UT_Vector2D& fieldOffset)
+	{
+		int flag = 0;
+		for (int i = 0; i < kCellCornerNum; ++i)
+		{
+			if (CornerValue(cell + kCellCornerOffset[i], resolution, fieldOffset) < isovalue)
+			{
+				flag |= 1 << i;
+			}
+		}
+		return flag;
+	}
+
+	bool MarchingSquare::CellIntersectCurve(const UT_Vector2I& cell, double resolution, double isovalue, const UT_Vector2D& fieldOffset)
+	{
+		auto bitmap = CalcCornerSignBitmap(cell, resolution, isovalue, fieldOffset);
+		return bitmap != 0 && bitmap != 0xF;
+	}
+
+	UT_Vector2D MarchingSquare::RootFind(const UT_Vector2I& s, const UT_Vector2I& e, double resolution, double isovalue, const UT_Vector2D& fieldOffset)
+	{
+		UT_Vector2D sPos = ToPosition(s, resolution) - fieldOffset;
+		UT_Vector2D ePos = ToPosition(e, resolution) - fieldOffset;
+
+		double sValue = CornerValue(s, resolution, fieldOffset);
+		double eValue = CornerValue(e, resolution, fieldOffset);
+		const double dt = 0.999999;
+		if (std::fabs(sValue - eValue) < 0.00001)
+		{
+			return (sPos + ePos) * 0.5;
+		}
+		if (std::fabs(isovalue - sValue) < 0.00001)
+		{
+			return dt * sPos + (1 - dt) * ePos;
+		}
+		if (std::fabs(isovalue - eValue) < 0.00001)
+		{
+			return dt * ePos + (1 - dt) * sPos;
+		}
+		UT_Vector2D pa, pb;
+		if (eValue < sValue)
+		{
+			pa = ePos;
+			pb = sPos;
+		}
+		else
+		{
+			pa = sPos;
+			pb = ePos;
+		}
+
+		for (int k = 0; k < kRootFindStepNum; ++k)
+		{
+			UT_Vector2D pm = (pa + pb) * 0.5;
+			if (implicit(pm.x(), pm.y()) < isovalue)
+			{
+				pa = pm;
+			}
+			else
+			{
+				pb = pm;
+			}
+		}
+		return (pa + pb) * 0.5;
+	}
+
+	int MarchingSquare::GetVertexIndexOnEdge(const UT_Vector2I& s, const UT_Vector2I& e, double resolution, double isovalue, const UT_Vector2D& fieldOffset)
+	{
+		auto edgeHash = EdgeHash(s, e);
+		int section = edgeHash % kEdgeVerticesSectionNum;
+		std::lock_guard verticesLock(_edgeVertexSectionMutex[section]);
+		auto it = _edgeVertexIndicesSections[section].find(edgeHash);
+		if (it != _edgeVertexIndicesSections[section].end())
+		{
+			return it->second;
+		}
+		int index = _tempVertexNum++;
+		_edgeVertexIndicesSections[section][edgeHash] = index;
+		// Always root find from the lower corner, so that the vertex doesn't
+		// depend on which of the two cells sharing the edge got here first.
+		if (e.x() < s.x() || e.y() < s.y())
+		{
+			_edgeVertexSections[section][edgeHash] = RootFind(e, s, resolution, isovalue, fieldOffset);
+		}
+		else
+		{
+			_edgeVertexSections[section][edgeHash] = RootFind(s, e, resolution, isovalue, fieldOffset);
+		}
+		return index;
+	}
+
+	void MarchingSquare::AddSegment(int a, int b, Int64 cellHash)
+	{
+		int section = cellHash % kCellSectionNum;
+		std::lock_guard segmentsLock(_segmentSectionMutex[section]);
+		_segmentSections[section].push_back(a);
+		_segmentSections[section].push_back(b);
+	}
+
+	void MarchingSquare::BuildSegmentsInCell(const UT_Vector2I& cell, double resolution, double isovalue, const UT_Vector2D& fieldOffset)
+	{
+		// Bit i is set when corner i is outside, (below the isovalue).
+		int cornerSignBitmap = CalcCornerSignBitmap(cell, resolution, isovalue, fieldOffset);
+		if (cornerSignBitmap == 0 || cornerSignBitmap == 0xF)
+		{
+			return;
+		}
+		// Segments are oriented with the inside on the left, so they start
+		// on an edge going from an inside corner to an outside corner, and
+		// end on an edge going from an outside corner to an inside corner.
+		int startEdges[2];
+		int endEdges[2];
+		int startNum = 0;
+		int endNum = 0;
+		int tempIndices[4];
+		for (int index = 0; index < 4; ++index)
+		{
+			int next = (index + 1) % 4;
+			bool sOutside = (cornerSignBitmap >> index) & 1;
+			bool eOutside = (cornerSignBitmap >> next) & 1;
+			if (sOutside == eOutside)
+			{
+				tempIndices[index] = -1;
+				continue;
+			}
+			tempIndices[index] = GetVertexIndexOnEdge(
+				cell + kCellCornerOffset[index],
+				cell + kCellCornerOffset[next],
+				resolution, isovalue, fieldOffset);
+			if (eOutside)
+			{
+				startEdges[startNum++] = index;
+			}
+			else
+			{
+				endEdges[endNum++] = index;
+			}
+		}
+		Int64 cellHash = CellHash(cell);
+		if (startNum == 1)
+		{
+			AddSegment(tempIndices[startEdges[0]], tempIndices[endEdges[0]], cellHash);
+			return;
+		}
+		// Saddle: the value at the centre decides whether the two inside
+		// corners are connected, (each segment then cuts off an outside
+		// corner), or not, (each segment cuts off an inside corner).
+		UT_Vector2D centre = ToPosition(cell, resolution) + UT_Vector2D(0.5 * resolution, 0.5 * resolution) - fieldOffset;
+		int endEdgeShift = (implicit(centre.x(), centre.y()) < isovalue) ? 3 : 1;
+		for (int i = 0; i < 2; ++i)
+		{
+			int endEdge = (startEdges[i] + endEdgeShift) % 4;
+			AddSegment(tempIndices[startEdges[i]], tempIndices[endEdge], cellHash);
+		}
+	}
+
+	void MarchingSquare::AssemblePolylines()
+	{
+		int vertexNum = _tempVertexNum;
+		_vertices.resize(vertexNum);
+		for (int section = 0; section < kEdgeVerticesSectionNum; ++section)
+		{
+			for (auto& pair : _edgeVertexIndicesSections[section])
+			{
+				_vertices[pair.second] = _edgeVertexSections[section][pair.first];
+			}
+		}
+
+		// Each vertex is on one cell edge, so it ends at most one segment and
+		// starts at most one segment.
+		std::vector<int> nextVertex(vertexNum, -1);
+		std::vector<int> prevVertex(vertexNum, -1);
+		for (int section = 0; section < kCellSectionNum; ++section)
+		{
+			for (int i = 0; i < _segmentSections[section].size(); i += 2)
+			{
+				int a = _segmentSections[section][i];
+				int b = _segmentSections[section][i + 1];
+				nextVertex[a] = b;
+				prevVertex[b] = a;
+			}
+		}
+
+		std::vector<bool> used(vertexNum, false);
+		// Open polylines first, (only where the curve leaves the bound),
+		// starting from their first vertex...
+		for (int start = 0; start < vertexNum; ++start)
+		{
+			if (prevVertex[start] != -1 || nextVertex[start] == -1)
+			{
+				continue;
+			}
+			Polyline polyline;
+			polyline.closed = false;
+			for (int v = start; v != -1 && !used[v]; v = nextVertex[v])
+			{
+				used[v] = true;
+				polyline.indices.push_back(v);
+			}
+			_polylines.push_back(std::move(polyline));
+		}
+		// ...then whatever is left forms closed loops.
+		for (int start = 0; start < vertexNum; ++start)
+		{
+			if (used[start] || nextVertex[start] == -1)
+			{
+				continue;
+			}
+			Polyline polyline;
+			polyline.closed = true;
+			for (int v = start; v != -1 && !used[v]; v = nextVertex[v])
+			{
+				used[v] = true;
+				polyline.indices.push_back(v);
+			}
+			_polylines.push_back(std::move(polyline));
+		}
+	}
+
+	void MarchingSquare::Build(
+		std::vector<UT_Vector2D>& seeds,
+		double resolution,
+		double isovalue,
+		UT_Vector2D bound,
+		UT_Vector2D fieldOffset
+	)
+	{
+		if (implicit == nullptr)
+		{
+			return;
+		}
+		Clear();
+		InitBuildCache();
+		UT_Vector2I cellBound = UT_Vector2I(
+			(int)std::min(std::ceil(bound.x() / resolution), (double)kBoundLimit),
+			(int)std::min(std::ceil(bound.y() / resolution), (double)kBoundLimit)
+		);
+
+		std::vector<UT_Vector2I> activeCells;
+		std::vector<UT_Vector2I> newActiveCells;
+		std::mutex activeCellMutex;
+		for (auto& seed : seeds)
+		{
+			auto cell = ToCell(seed + fieldOffset, resolution);
+			if (InBound(cell, cellBound) && TrySetCellActive(cell))
+			{
+				activeCells.push_back(cell);
+			}
+		}
+		while (activeCells.size() > 0)
+		{
+			tbb::parallel_for(tbb::blocked_range<int>(0, activeCells.size()), [&](tbb::blocked_range<int> r)
+				{
+					for (int i = r.begin(); i < r.end(); ++i)
+					{
+						std::vector<UT_Vector2I> cellStack;
+						cellStack.push_back(activeCells[i]);
+						for (int count = 0; count < kContinuousCellNumLimit; ++count)
+						{
+							if (!cellStack.size())
+							{
+								break;
+							}
+							auto currentCell = cellStack.back();
+							cellStack.pop_back();
+
+							BuildSegmentsInCell(currentCell, resolution, isovalue, fieldOffset);
+
+							for (int nindex = 0; nindex < kNeighbourCellDirectionArrLength; ++nindex)
+							{
+								UT_Vector2I ncell = currentCell + kNeighbourCellDirection[nindex];
+								if (InBound(ncell, cellBound)
+									&& CellIntersectCurve(ncell, resolution, isovalue, fieldOffset)
+									&& TrySetCellActive(ncell))
+								{
+									cellStack.push_back(ncell);
+								}
+							}
+						}
+						if (cellStack.size() > 0)
+						{
+							std::lock_guard guard(activeCellMutex);
+							for (auto& x : cellStack)
+							{
+								newActiveCells.push_back(x);
+							}
+						}
+					}
+				}
+			);
+			activeCells.clear();
+			std::swap(newActiveCells, activeCells);
+		}
+		AssemblePolylines();
+		InitBuildCache();
+	}
+
+	std::vector<MarchingSquare::Polyline>& MarchingSquare::GetPolylines()
+	{
+		return _polylines;
+	}
+
+	std::vector<UT_Vector2D>& MarchingSquare::GetVertices()
+	{
+		return _vertices;
+	}
+
+	void MarchingSquare::Clear()
+	{
+		_vertices.clear();
+		_polylines.clear();
+	}
+
+	void MarchingSquare::InitBuildCache()
+	{
+		for (int section = 0; section < kCellSectionNum; ++section)
+		{
+			_visitedCellSections[section].clear();
+			_segmentSections[section].clear();
+		}
+		for (int section = 0; section < kCornerSectionNum; ++section)
+		{
+			_cornerValueSections[section].clear();
+		}
+		for (int section = 0; section < kEdgeVerticesSectionNum; ++section)
+		{
+			_edgeVertexIndicesSections[section].clear();
+			_edgeVertexSections[section].clear();
+		}
+		_tempVertexNum = 0;
+	}
+}
@@ -0,0 +1,71 @@
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <mutex>
+#include <atomic>
+#include <UT/UT_VectorTypes.h>
+#include <UT/UT_Vector2.h>
+#include <SYS/SYS_Math.h>
+#include <functional>
+namespace Geometry
+{
+    typedef int64_t Int64;
+    /// 2D counterpart of MarchingCube: extracts isolines of an implicit
+    /// function of (u, v), starting from seed points and flood filling
+    /// through the cells the isoline passes through.  Vertices on shared
+    /// cell edges are deduplicated, so the segments are stitched into
+    /// polylines, which are closed unless they leave the bound.
+    class MarchingSquare
+    {
+    public:
+        struct Polyline
+        {
+            std::vector<int> indices;
+            bool closed;
+        };
+        void Build(
+            std::vector<UT_Vector2D>& seeds,
+            double resolution,
+            double isovalue,
+            UT_Vector2D bound,
+            UT_Vector2D fieldOffset
+        );
+        void Clear();
+        std::vector<Polyline>& GetPolylines();
+        std::vector<UT_Vector2D>& GetVertices();
+        std::function<double(double, double)> implicit;
+    private:
+        bool TrySetCellActive(const UT_Vector2I& cell);
+        double CornerValue(const UT_Vector2I& corner, double resolution, const UT_Vector2D& fieldOffset);
+        int CalcCornerSignBitmap(const UT_Vector2I& cell, double resolution, double isovalue, const UT_Vector2D& fieldOffset);
+        bool CellIntersectCurve(const UT_Vector2I& cell, double resolution, double isovalue, const UT_Vector2D& fieldOffset);
+        void BuildSegmentsInCell(const UT_Vector2I& cell, double resolution, double isovalue, const UT_Vector2D& fieldOffset);
+        int GetVertexIndexOnEdge(const UT_Vector2I& s, const UT_Vector2I& e, double resolution, double isovalue, const UT_Vector2D& fieldOffset);
+        UT_Vector2D RootFind(const UT_Vector2I& s, const UT_Vector2I& e, double resolution, double isovalue, const UT_Vector2D& fieldOffset);
+        void AddSegment(int a, int b, Int64 cellHash);
+        void AssemblePolylines();
+        void InitBuildCache();
+    private:
+        std::vector<Polyline> _polylines;
+        std::vector<UT_Vector2D> _vertices;
+
+        const static int kCellSectionNum = 64;
+        std::unordered_set<Int64> _visitedCellSections[kCellSectionNum];
+        std::mutex _visitedCellSectionMutex[kCellSectionNum];
+
+        // Each corner is shared by up to 4 cells, and every neighbour test
+        // samples all 4 corners, so the samples are cached.
+        const static int kCornerSectionNum = 64;
+        std::unordered_map<Int64, double> _cornerValueSections[kCornerSectionNum];
+        std::mutex _cornerValueSectionMutex[kCornerSectionNum];
+
+        const static int kEdgeVerticesSectionNum = 64;
+        std::atomic_int _tempVertexNum;
+        std::unordered_map<Int64, int> _edgeVertexIndicesSections[kEdgeVerticesSectionNum];
+        std::unordered_map<Int64, UT_Vector2D> _edgeVertexSections[kEdgeVerticesSectionNum];
+        std::mutex _edgeVertexSectionMutex[kEdgeVerticesSectionNum];
+
+        std::vector<int> _segmentSections[kCellSectionNum];
+        std::mutex _segmentSectionMutex[kCellSectionNum];
+    };
+}
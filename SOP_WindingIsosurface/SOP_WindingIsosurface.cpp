@@ -33,6 +33,7 @@
 #include <vector>
 #include <functional>
 #include "MarchingCube.h"
+#include "MarchingSquare.h"
 typedef int64_t Int64;
 
 class PRM_Template;
@@ -137,17 +138,21 @@ protected:
 #include <GEO/GEO_PrimTetrahedron.h>
 #include <GEO/GEO_TPSurf.h>
 #include <GA/GA_Handle.h>
+#include <GA/GA_PageHandle.h>
+#include <GA/GA_PageIterator.h>
 #include <GA/GA_SplittableRange.h>
 #include <GA/GA_Types.h>
 #include <OP/OP_Operator.h>
 #include <OP/OP_OperatorTable.h>
 #include <PRM/PRM_TemplateBuilder.h>
+#include <UT/UT_BoundingBox.h>
 #include <UT/UT_DSOVersion.h>
 #include <UT/UT_Interrupt.h>
 #include <UT/UT_ParallelUtil.h>
 #include <UT/UT_StringHolder.h>
 #include <UT/UT_UniquePtr.h>
 #include <SYS/SYS_Math.h>
+#include <algorithm>
 
 // UT_SolidAngle doesn't currently have a special case to handle quads correctly
 // as bilinear patches; it always treats them as two triangles, which can result
@@ -181,6 +186,13 @@ sopAccumulateSegments(
     const UT_Array<int> &ptmap,
     UT_Array<int> &segment_points);
 
+static void
+sopAccumulateExactElements(
+    const GA_Detail *const mesh_geo,
+    const GA_Offset primoff,
+    const bool quads,
+    UT_Array<int> &element_points);
+
 // This gives easy access to the enum types for this operator's parameter
 using namespace SOP_WindingIsosurfaceEnums;
 
@@ -191,6 +203,118 @@ using namespace SOP_WindingIsosurfaceEnums;
 typedef int64                   GA_DataId;
 #define GA_INVALID_DATAID       GA_DataId(-1)
 
+/// Calls accumulate on every primitive in prim_group, (or all primitives),
+/// in parallel, producing exactly the same point list as calling it serially
+/// in primitive order.  The primitives are split into fixed-size chunks, each
+/// chunk accumulates into its own array, and then the chunks are copied into
+/// place in parallel, after a prefix sum of their sizes.
+template<typename ACCUMULATE>
+static void
+sopAccumulateParallel(
+    const GA_Detail &mesh_geo,
+    const GA_PrimitiveGroup *prim_group,
+    const UT_Array<int> &ptmap,
+    UT_Array<int> &points,
+    const ACCUMULATE &accumulate)
+{
+    // Chunks don't depend on the thread count, so neither does the output.
+    constexpr GA_Size CHUNK_SIZE = 1024;
+    UT_Array<std::pair<GA_Offset,GA_Offset>> chunks;
+    GA_Offset start;
+    GA_Offset end;
+    for (GA_Iterator it(mesh_geo.getPrimitiveRange(prim_group)); it.blockAdvance(start,end); )
+    {
+        for (GA_Offset chunk_start = start; chunk_start < end; chunk_start += CHUNK_SIZE)
+            chunks.append(std::make_pair(chunk_start, SYSmin(GA_Offset(chunk_start + CHUNK_SIZE), end)));
+    }
+
+    const exint nchunks = chunks.size();
+    UT_Array<UT_Array<int>> chunk_points;
+    chunk_points.setSize(nchunks);
+    UTparallelFor(UT_BlockedRange<exint>(0, nchunks), [&mesh_geo,&ptmap,&chunks,&chunk_points,&accumulate](const UT_BlockedRange<exint> &r)
+    {
+        for (exint chunki = r.begin(), chunkend = r.end(); chunki < chunkend; ++chunki)
+        {
+            UT_Array<int> &local_points = chunk_points[chunki];
+            for (GA_Offset primoff = chunks[chunki].first; primoff < chunks[chunki].second; ++primoff)
+                accumulate(&mesh_geo, primoff, ptmap, local_points);
+        }
+    });
+
+    UT_Array<exint> chunk_starts;
+    chunk_starts.setSizeNoInit(nchunks+1);
+    chunk_starts[0] = 0;
+    for (exint chunki = 0; chunki < nchunks; ++chunki)
+        chunk_starts[chunki+1] = chunk_starts[chunki] + chunk_points[chunki].size();
+
+    points.setSizeNoInit(chunk_starts[nchunks]);
+    UTparallelForLightItems(UT_BlockedRange<exint>(0, nchunks), [&points,&chunk_starts,&chunk_points](const UT_BlockedRange<exint> &r)
+    {
+        for (exint chunki = r.begin(), chunkend = r.end(); chunki < chunkend; ++chunki)
+        {
+            const UT_Array<int> &local_points = chunk_points[chunki];
+            if (!local_points.isEmpty())
+                std::copy(local_points.begin(), local_points.end(), points.array() + chunk_starts[chunki]);
+        }
+    });
+}
+
+/// Fills ptmap with the index of each point in mesh_ptgroup, in offset order,
+/// and calls set_point(ptoff, ptnum) for each of them, all in parallel.
+/// Returns the number of points in the group.
+template<typename SET_POINT>
+static GA_Size
+sopCompactPointsParallel(
+    const GA_Detail &mesh_geo,
+    const GA_PointGroup &mesh_ptgroup,
+    UT_Array<int> &ptmap,
+    const SET_POINT &set_point)
+{
+    const GA_Size noffsets = mesh_geo.getNumPointOffsets();
+    ptmap.setSizeNoInit(noffsets);
+
+    const exint nchunks = (noffsets + GA_PAGE_SIZE-1) / GA_PAGE_SIZE;
+    UT_Array<int> chunk_starts;
+    chunk_starts.setSizeNoInit(nchunks+1);
+    chunk_starts[0] = 0;
+
+    // First pass: count the group members in each page of offsets.
+    UTparallelForLightItems(UT_BlockedRange<exint>(0, nchunks), [&mesh_ptgroup,&chunk_starts,noffsets](const UT_BlockedRange<exint> &r)
+    {
+        for (exint chunki = r.begin(), chunkend = r.end(); chunki < chunkend; ++chunki)
+        {
+            const GA_Offset start(chunki*GA_PAGE_SIZE);
+            const GA_Offset end(SYSmin(GA_Size(start) + GA_PAGE_SIZE, noffsets));
+            int count = 0;
+            for (GA_Offset ptoff = start; ptoff < end; ++ptoff)
+                count += mesh_ptgroup.containsOffset(ptoff);
+            chunk_starts[chunki+1] = count;
+        }
+    });
+    for (exint chunki = 0; chunki < nchunks; ++chunki)
+        chunk_starts[chunki+1] += chunk_starts[chunki];
+
+    // Second pass: number the group members, starting from each page's prefix sum.
+    UTparallelForLightItems(UT_BlockedRange<exint>(0, nchunks), [&mesh_ptgroup,&chunk_starts,&ptmap,&set_point,noffsets](const UT_BlockedRange<exint> &r)
+    {
+        for (exint chunki = r.begin(), chunkend = r.end(); chunki < chunkend; ++chunki)
+        {
+            const GA_Offset start(chunki*GA_PAGE_SIZE);
+            const GA_Offset end(SYSmin(GA_Size(start) + GA_PAGE_SIZE, noffsets));
+            int ptnum = chunk_starts[chunki];
+            for (GA_Offset ptoff = start; ptoff < end; ++ptoff)
+            {
+                if (!mesh_ptgroup.containsOffset(ptoff))
+                    continue;
+                ptmap[ptoff] = ptnum;
+                set_point(ptoff, ptnum);
+                ++ptnum;
+            }
+        }
+    });
+    return chunk_starts[nchunks];
+}
+
 /// This class is for caching data between cooks, e.g. so that we don't have to
 /// rebuild the UT_SolidAngle tree on every cook if the input hasn't changed.
 class SOP_WindingNumberCache : public SOP_NodeCache
@@ -203,6 +327,7 @@ public:
         , myPrimitiveListDataID(GA_INVALID_DATAID)
         , myPDataID(GA_INVALID_DATAID)
         , myApproxOrder(-1)
+        , myRecentre(false)
         , myAxis0(-1)
         , myHadGroup(false)
         , myGroupString()
@@ -211,17 +336,100 @@ public:
     {}
     virtual ~SOP_WindingNumberCache() {}
 
-    void update3D(const GA_Detail &mesh_geo, const GA_PrimitiveGroup *prim_group, const UT_StringHolder &group_string,const int approx_order)
+    /// Builds the buffers for full accuracy mode: every triangle and quad that
+    /// UT_SolidAngleSoA can evaluate, plus a list of the remaining primitives,
+    /// (spheres and NURBS/Bezier surfaces), which are evaluated directly.
+    /// NOTE: The exact buffers have no approximation order, so they're keyed
+    ///       with an order of -1, which never matches one of the trees.
+    void updateExact3D(const GA_Detail &mesh_geo, const GA_PrimitiveGroup *prim_group, const UT_StringHolder &group_string)
+    {
+        const GA_DataId topology_data_id = mesh_geo.getTopology().getDataId();
+        const GA_DataId primitive_list_data_id = mesh_geo.getPrimitiveList().getDataId();
+        const GA_DataId P_data_id = mesh_geo.getP()->getDataId();
+        const bool has_group = (prim_group != nullptr);
+        if (mySolidAngleTree.isClear() &&
+            mySubtendedAngleTree.isClear() &&
+            topology_data_id == myTopologyDataID &&
+            primitive_list_data_id == myPrimitiveListDataID &&
+            P_data_id == myPDataID &&
+            myApproxOrder == -1 &&
+            has_group == myHadGroup &&
+            (!has_group || (
+                group_string == myGroupString &&
+                mesh_geo.getUniqueId() == myUniqueId &&
+                mesh_geo.getMetaCacheCount() == myMetaCacheCount)))
+        {
+            return;
+        }
+        clear();
+
+        UT_AutoInterrupt boss("Gathering Triangles");
+
+        myTopologyDataID = topology_data_id;
+        myPrimitiveListDataID = primitive_list_data_id;
+        myPDataID = P_data_id;
+        myHadGroup = has_group;
+        myGroupString = group_string;
+        myUniqueId = mesh_geo.getUniqueId();
+        myMetaCacheCount = mesh_geo.getMetaCacheCount();
+
+        // Double-precision copy of all point positions, indexed by point index.
+        UT_Array<UT_Vector3D> positions;
+        positions.setSizeNoInit(mesh_geo.getNumPoints());
+        UTparallelForLightItems(GA_SplittableRange(mesh_geo.getPointRange()), [&mesh_geo,&positions](const GA_SplittableRange &r)
+        {
+            GA_Offset start;
+            GA_Offset end;
+            for (GA_Iterator it(r); it.blockAdvance(start, end); )
+            {
+                exint ptnum = mesh_geo.pointIndex(start);
+                for (GA_Offset ptoff = start; ptoff < end; ++ptoff, ++ptnum)
+                    positions[ptnum] = mesh_geo.getPos3D(ptoff);
+            }
+        });
+
+        const UT_Array<int> no_ptmap;
+        UT_Array<int> triangle_points;
+        UT_Array<int> quad_points;
+        sopAccumulateParallel(mesh_geo, prim_group, no_ptmap, triangle_points,
+            [](const GA_Detail *const mesh_geo, const GA_Offset primoff, const UT_Array<int> &, UT_Array<int> &points)
+            { sopAccumulateExactElements(mesh_geo, primoff, false, points); });
+        sopAccumulateParallel(mesh_geo, prim_group, no_ptmap, quad_points,
+            [](const GA_Detail *const mesh_geo, const GA_Offset primoff, const UT_Array<int> &, UT_Array<int> &points)
+            { sopAccumulateExactElements(mesh_geo, primoff, true, points); });
+
+        myExactOtherPrims.clear();
+        GA_Offset start;
+        GA_Offset end;
+        for (GA_Iterator it(mesh_geo.getPrimitiveRange(prim_group)); it.blockAdvance(start, end); )
+        {
+            for (GA_Offset primoff = start; primoff < end; ++primoff)
+            {
+                const int primtype = mesh_geo.getPrimitiveTypeId(primoff);
+                if (primtype == GEO_PRIMSPHERE || primtype == GEO_PRIMNURBSURF || primtype == GEO_PRIMBEZSURF)
+                    myExactOtherPrims.append(primoff);
+            }
+        }
+
+        myExactSolidAngle.init(
+            triangle_points.size()/3, triangle_points.array(),
+            quad_points.size()/4, quad_points.array(),
+            positions.array());
+    }
+
+    void update3D(const GA_Detail &mesh_geo, const GA_PrimitiveGroup *prim_group, const UT_StringHolder &group_string,const int approx_order, const bool recentre = false)
     {
         const GA_DataId topology_data_id = mesh_geo.getTopology().getDataId();
         const GA_DataId primitive_list_data_id = mesh_geo.getPrimitiveList().getDataId();
         const GA_DataId P_data_id = mesh_geo.getP()->getDataId();
         const bool has_group = (prim_group != nullptr);
         if (mySubtendedAngleTree.isClear() &&
+            myExactSolidAngle.isClear() &&
             topology_data_id == myTopologyDataID &&
             primitive_list_data_id == myPrimitiveListDataID &&
             P_data_id == myPDataID &&
             approx_order == myApproxOrder &&
+            recentre == myRecentre &&
             has_group == myHadGroup &&
             (!has_group || (
                 group_string == myGroupString &&
@@ -232,6 +440,8 @@ public:
         }
         mySubtendedAngleTree.clear();
         myPositions2D.clear();
+        myExactSolidAngle.clear();
+        myExactOtherPrims.clear();
 
         UT_AutoInterrupt boss("Constructing Solid Angle Tree");
 
@@ -239,6 +449,7 @@ public:
         myPrimitiveListDataID = primitive_list_data_id;
         myPDataID = P_data_id;
         myApproxOrder = approx_order;
+        myRecentre = recentre;
         myHadGroup = has_group;
         myGroupString = group_string;
         myUniqueId = mesh_geo.getUniqueId();
@@ -261,27 +472,15 @@ public:
             GA_PointGroup mesh_ptgroup(mesh_geo);
             mesh_ptgroup.combine(prim_group);
             myPositions3D.setSizeNoInit(mesh_ptgroup.entries());
-            ptmap.setSizeNoInit(mesh_geo.getNumPointOffsets());
-            int ptnum = 0;
-            mesh_geo.forEachPoint(&mesh_ptgroup, [&mesh_geo,this,&ptmap,&ptnum](const GA_Offset ptoff)
+            sopCompactPointsParallel(mesh_geo, mesh_ptgroup, ptmap, [&mesh_geo,this](const GA_Offset ptoff, const int ptnum)
             {
-                ptmap[ptoff] = ptnum;
                 myPositions3D[ptnum] = mesh_geo.getPos3(ptoff);
-                ++ptnum;
             });
         }
 
-        GA_Offset start;
-        GA_Offset end;
-        for (GA_Iterator it(mesh_geo.getPrimitiveRange(prim_group)); it.blockAdvance(start,end); )
-        {
-            for (GA_Offset primoff = start; primoff < end; ++primoff)
-            {
-                sopAccumulateTriangles(&mesh_geo, primoff, ptmap, myTrianglePoints);
-            }
-        }
+        sopAccumulateParallel(mesh_geo, prim_group, ptmap, myTrianglePoints, sopAccumulateTriangles);
 
-        mySolidAngleTree.init(myTrianglePoints.size()/3, myTrianglePoints.array(), myPositions3D.size(), myPositions3D.array(), approx_order);
+        mySolidAngleTree.init(myTrianglePoints.size()/3, myTrianglePoints.array(), myPositions3D.size(), myPositions3D.array(), approx_order, recentre);
     }
 
     void update2D(
@@ -296,6 +495,7 @@ public:
         const GA_DataId P_data_id = mesh_geo.getP()->getDataId();
         const bool has_group = (prim_group != nullptr);
         if (mySolidAngleTree.isClear() &&
+            myExactSolidAngle.isClear() &&
             topology_data_id == myTopologyDataID &&
             primitive_list_data_id == myPrimitiveListDataID &&
             P_data_id == myPDataID &&
@@ -311,6 +511,8 @@ public:
         }
         mySolidAngleTree.clear();
         myPositions3D.clear();
+        myExactSolidAngle.clear();
+        myExactOtherPrims.clear();
 
         UT_AutoInterrupt boss("Constructing Solid Angle Tree");
 
@@ -335,12 +537,20 @@ public:
         {
             // Copy all point positions
             myPositions2D.setSizeNoInit(mesh_geo.getNumPoints());
-            int ptnum = 0;
-            mesh_geo.forEachPoint([&mesh_geo,this,&ptnum,axis0,axis1](const GA_Offset ptoff)
+            UTparallelForLightItems(GA_SplittableRange(mesh_geo.getPointRange()), [&mesh_geo,this,axis0,axis1](const GA_SplittableRange &r)
             {
-                UT_Vector3 pos = mesh_geo.getPos3(ptoff);
-                myPositions2D[ptnum] = UT_Vector2(pos[axis0],pos[axis1]);
-                ++ptnum;
+                GA_Offset start;
+                GA_Offset end;
+                for (GA_Iterator it(r); it.blockAdvance(start, end); )
+                {
+                    // Point indices are contiguous within a block of offsets.
+                    exint ptnum = mesh_geo.pointIndex(start);
+                    for (GA_Offset ptoff = start; ptoff < end; ++ptoff, ++ptnum)
+                    {
+                        UT_Vector3 pos = mesh_geo.getPos3(ptoff);
+                        myPositions2D[ptnum] = UT_Vector2(pos[axis0],pos[axis1]);
+                    }
+                }
             });
         }
         else
@@ -349,26 +559,14 @@ public:
             GA_PointGroup mesh_ptgroup(mesh_geo);
             mesh_ptgroup.combine(prim_group);
             myPositions2D.setSizeNoInit(mesh_ptgroup.entries());
-            ptmap.setSizeNoInit(mesh_geo.getNumPointOffsets());
-            int ptnum = 0;
-            mesh_geo.forEachPoint(&mesh_ptgroup, [&mesh_geo,this,&ptmap,&ptnum,axis0,axis1](const GA_Offset ptoff)
+            sopCompactPointsParallel(mesh_geo, mesh_ptgroup, ptmap, [&mesh_geo,this,axis0,axis1](const GA_Offset ptoff, const int ptnum)
             {
-                ptmap[ptoff] = ptnum;
                 UT_Vector3 pos = mesh_geo.getPos3(ptoff);
                 myPositions2D[ptnum] = UT_Vector2(pos[axis0],pos[axis1]);
-                ++ptnum;
             });
         }
 
-        GA_Offset start;
-        GA_Offset end;
-        for (GA_Iterator it(mesh_geo.getPrimitiveRange(prim_group)); it.blockAdvance(start,end); )
-        {
-            for (GA_Offset primoff = start; primoff < end; ++primoff)
-            {
-                sopAccumulateSegments(&mesh_geo, primoff, ptmap, myTrianglePoints);
-            }
-        }
+        sopAccumulateParallel(mesh_geo, prim_group, ptmap, myTrianglePoints, sopAccumulateSegments);
 
         mySubtendedAngleTree.init(myTrianglePoints.size()/2, myTrianglePoints.array(), myPositions2D.size(), myPositions2D.array(), approx_order);
     }
@@ -377,6 +575,8 @@ public:
     {
         mySolidAngleTree.clear();
         mySubtendedAngleTree.clear();
+        myExactSolidAngle.clear();
+        myExactOtherPrims.clear();
         myTrianglePoints.setCapacity(0);
         myPositions2D.setCapacity(0);
         myPositions3D.setCapacity(0);
@@ -384,6 +584,7 @@ public:
         myPrimitiveListDataID = GA_INVALID_DATAID;
         myPDataID = GA_INVALID_DATAID;
         myApproxOrder = -1;
+        myRecentre = false;
         myHadGroup = false;
         myGroupString.clear();
         myUniqueId = -1;
@@ -392,6 +593,8 @@ public:
 
     UT_SolidAngle<float,float> mySolidAngleTree;
     UT_SubtendedAngle<float,float> mySubtendedAngleTree;
+    UT_SolidAngleSoA<double> myExactSolidAngle;
+    GA_OffsetList myExactOtherPrims;
     UT_Array<int> myTrianglePoints;
     UT_Array<UT_Vector2> myPositions2D;
     UT_Array<UT_Vector3> myPositions3D;
@@ -399,6 +602,7 @@ public:
     GA_DataId myPrimitiveListDataID;
     GA_DataId myPDataID;
     int myApproxOrder;
+    bool myRecentre;
     int myAxis0;
     bool myHadGroup;
     UT_StringHolder myGroupString;
@@ -559,6 +763,7 @@ const char *const SOP_WindingNumberVerb::theDsFile = R"THEDSFILE(
         label "Grid Resolution"
         type float
         default { "0.1" }
+        hidewhen "{ output == attrib }"
     }
     parm {
         name "isovalue"
@@ -566,6 +771,7 @@ const char *const SOP_WindingNumberVerb::theDsFile = R"THEDSFILE(
         label "Isovalue"
         type float
         default { "0.5" }
+        hidewhen "{ output == attrib }"
     }
     parm {
         name "bound"
@@ -574,6 +780,7 @@ const char *const SOP_WindingNumberVerb::theDsFile = R"THEDSFILE(
         type vector
         size 3
         default { "65535" "65535" "65535" }
+        hidewhen "{ output == attrib }"
     }
     parm {
         name "fieldOffset"
@@ -582,6 +789,27 @@ const char *const SOP_WindingNumberVerb::theDsFile = R"THEDSFILE(
         type vector
         size 3
         default { "-32767" "-32767" "-32767" }
+        hidewhen "{ output == attrib }"
+    }
+    parm {
+        name    "recentre"
+        cppname "Recentre"
+        label   "Recentre Tree Nodes"
+        type    toggle
+        default { "0" }
+        disablewhen "{ fullaccuracy == 1 }"
+        help    "Store the data of every tree node relative to its own centre of mass, in double precision, and sum the contributions with compensation. Keeps the winding number accurate for meshes far from the origin or with a very large extent."
+    }
+    parm {
+        name    "output"
+        cppname "Output"
+        label   "Output"
+        type    ordinal
+        default { "0" }
+        menu {
+            "surface"   "Isosurface"
+            "attrib"    "Point Attribute"
+        }
     }
 }
 )THEDSFILE";
@@ -1168,6 +1396,127 @@ sopAccumulateTriangles(
     }
 }
 
+/// Like sopAccumulateTriangles, but for the exact full accuracy buffers,
+/// which always index points by point index.  If quads is true, only the
+/// quads that are evaluated as bilinear patches are accumulated, (4 points
+/// each), else only the triangles are, (3 points each), to match
+/// sopSumContributions3D.  Surfaces other than meshes and spheres aren't
+/// accumulated at all.
+static void
+sopAccumulateExactElements(
+    const GA_Detail *const mesh_geo,
+    const GA_Offset primoff,
+    const bool quads,
+    UT_Array<int> &element_points)
+{
+    const bool quads_as_patches = QUADS_AS_BILINEAR_PATCHES;
+    int primtype = mesh_geo->getPrimitiveTypeId(primoff);
+    if (primtype == GA_PRIMPOLY || primtype == GA_PRIMPOLYSOUP)
+    {
+        auto &&accumulate_polygon = [mesh_geo,quads,quads_as_patches,&element_points](const GA_Size n, const auto &point_offset)
+        {
+            if (n < 3)
+                return;
+            if (n == 4 && quads_as_patches)
+            {
+                if (quads)
+                {
+                    for (GA_Size i = 0; i < 4; ++i)
+                        element_points.append(int(mesh_geo->pointIndex(point_offset(i))));
+                }
+                return;
+            }
+            if (quads)
+                return;
+
+            // A triangle fan suffices, even if the polygon is non-convex,
+            // because the contributions in the opposite direction will
+            // partly cancel out the ones in the other direction,
+            // in just the right amount.
+            const int p0i = int(mesh_geo->pointIndex(point_offset(0)));
+            int previ = int(mesh_geo->pointIndex(point_offset(1)));
+            for (GA_Size i = 2; i < n; ++i)
+            {
+                const int nexti = int(mesh_geo->pointIndex(point_offset(i)));
+                element_points.append(p0i);
+                element_points.append(previ);
+                element_points.append(nexti);
+                previ = nexti;
+            }
+        };
+
+        if (primtype == GA_PRIMPOLY)
+        {
+            const GA_OffsetListRef vertices = mesh_geo->getPrimitiveVertexList(primoff);
+            if (!vertices.getExtraFlag())
+                return;
+            accumulate_polygon(vertices.size(), [mesh_geo,&vertices](const GA_Size i)
+            { return mesh_geo->vertexPoint(vertices(i)); });
+        }
+        else
+        {
+            const GEO_PrimPolySoup *soup = UTverify_cast<const GEO_PrimPolySoup *>(mesh_geo->getPrimitive(primoff));
+            for (GEO_PrimPolySoup::PolygonIterator poly(*soup); !poly.atEnd(); ++poly)
+            {
+                accumulate_polygon(poly.nvertices(), [&poly](const GA_Size i)
+                { return poly.getPointOffset(i); });
+            }
+        }
+    }
+    else if (primtype == GA_PRIMTETRAHEDRON)
+    {
+        if (quads)
+            return;
+
+        const GA_OffsetListRef vertices = mesh_geo->getPrimitiveVertexList(primoff);
+        const GEO_PrimTetrahedron tet(SYSconst_cast(mesh_geo), primoff, vertices);
+
+        for (int i = 0; i < 4; ++i)
+        {
+            // Ignore shared tet faces.  They would contribute exactly opposite amounts.
+            if (tet.isFaceShared(i))
+                continue;
+
+            const int *face_indices = GEO_PrimTetrahedron::fastFaceIndices(i);
+            for (int j = 0; j < 3; ++j)
+                element_points.append(int(mesh_geo->pointIndex(mesh_geo->vertexPoint(vertices(face_indices[j])))));
+        }
+    }
+    else if (primtype == GEO_PRIMMESH)
+    {
+        if (quads != quads_as_patches)
+            return;
+
+        const GEO_PrimMesh *mesh = UTverify_cast<const GEO_PrimMesh *>(mesh_geo->getPrimitive(primoff));
+        const int nquadrows = mesh->getNumRows() - !mesh->isWrappedV();
+        const int nquadcols = mesh->getNumCols() - !mesh->isWrappedU();
+        for (int row = 0; row < nquadrows; ++row)
+        {
+            for (int col = 0; col < nquadcols; ++col)
+            {
+                GEO_Hull::Poly poly(*mesh, row, col);
+                const int ai = int(mesh_geo->pointIndex(poly.getPointOffset(0)));
+                const int bi = int(mesh_geo->pointIndex(poly.getPointOffset(1)));
+                const int ci = int(mesh_geo->pointIndex(poly.getPointOffset(2)));
+                const int di = int(mesh_geo->pointIndex(poly.getPointOffset(3)));
+                element_points.append(ai);
+                element_points.append(bi);
+                element_points.append(ci);
+                if (quads)
+                {
+                    element_points.append(di);
+                }
+                else
+                {
+                    element_points.append(ai);
+                    element_points.append(ci);
+                    element_points.append(di);
+                }
+            }
+        }
+    }
+}
+
 static void
 sopAccumulateSegments(
     const GA_Detail *const mesh_geo,
@@ -1263,102 +1612,146 @@ sopAccumulateSegments(
     }
 }
 
+/// Spreads the low 10 bits of x out to every third bit.
+static SYS_FORCE_INLINE uint32
+sopExpandBits10(uint32 x)
+{
+    x &= 0x3FF;
+    x = (x | (x << 16)) & 0x030000FF;
+    x = (x | (x <<  8)) & 0x0300F00F;
+    x = (x | (x <<  4)) & 0x030C30C3;
+    x = (x | (x <<  2)) & 0x09249249;
+    return x;
+}
+
+/// Evaluates eval(query_point) for every point in point_range, and writes
+/// the results to winding_number_attrib, one page at a time.  P is read and
+/// the attribute is written through page handles, instead of per-point
+/// handle lookups, and the points in each page are evaluated in Morton order
+/// within the page's bounding box, so that consecutive queries traverse
+/// mostly the same parts of the tree.
+template<typename EVAL>
 static void
-sop3DFullAccuracy(
+sopEvaluatePages(
     const GEO_Detail *const query_points,
     const GA_SplittableRange &point_range,
-    const GEO_Detail *const mesh_geo,
-    const GA_PrimitiveGroup *const mesh_prim_group,
     const GA_RWHandleF &winding_number_attrib,
-    const bool as_solid_angle,
-    const bool negate)
+    UT_AutoInterrupt &boss,
+    const EVAL &eval)
 {
-    UT_AutoInterrupt boss("Computing Winding Numbers");
-
-    // See comment below for why we create this GA_Offsetlist of mesh primitive offsets.
-    GA_OffsetList primoffs;
-    if (!mesh_prim_group && mesh_geo->getPrimitiveMap().isTrivialMap())
-    {
-        primoffs.setTrivial(GA_Offset(0), mesh_geo->getNumPrimitives());
-    }
-    else
+    UTparallelFor(point_range, [query_points,&winding_number_attrib,&boss,&eval](const GA_SplittableRange &r)
     {
-        GA_Offset start;
-        GA_Offset end;
-        for (GA_Iterator it(mesh_geo->getPrimitiveRange(mesh_prim_group)); it.fullBlockAdvance(start, end); )
+        GA_ROPageHandleV3 P_ph(query_points->getP());
+        GA_RWPageHandleF attrib_ph(winding_number_attrib.getAttribute());
+        UT_Array<GA_Offset> offsets;
+        UT_Array<UT_Vector3D> positions;
+        UT_Array<std::pair<uint32,int>> order;
+        offsets.setCapacity(GA_PAGE_SIZE);
+        positions.setCapacity(GA_PAGE_SIZE);
+        order.setCapacity(GA_PAGE_SIZE);
+
+        for (GA_PageIterator pit = r.beginPages(); !pit.atEnd(); ++pit)
         {
-            primoffs.setTrivialRange(primoffs.size(), start, end-start);
-        }
-    }
+            if (boss.wasInterrupted())
+                return;
 
-    UTparallelFor(point_range, [query_points,mesh_geo,winding_number_attrib,&primoffs,as_solid_angle,negate,&boss](const GA_SplittableRange &r)
-    {
-        GA_Offset start;
-        GA_Offset end;
-        for (GA_Iterator it(r); it.blockAdvance(start, end); )
-        {
-            for (GA_Offset ptoff = start; ptoff != end; ++ptoff)
+            offsets.setSize(0);
+            positions.setSize(0);
+            GA_Offset start;
+            GA_Offset end;
+            for (GA_Iterator it(pit.begin()); it.blockAdvance(start, end); )
             {
-                if (boss.wasInterrupted())
-                    return;
-
-                const UT_Vector3 query_point = query_points->getPos3(ptoff);
-
-                // NOTE: We can't use UTparallelReduce, because that would have
-                //       nondeterministic roundoff error due to floating-point
-                //       addition being non-associative.  We can't just use
-                //       UTparallelInvoke with GA_SplittableRange either, because
-                //       the roundoff error would change with defragmentation,
-                //       e.g. from locking the mesh input and reloading the HIP file.
-                //       Instead, we always split in the middle of the list of offsets.
-                double sum;
-                sopSumContributions3D(&sum, query_point, mesh_geo, primoffs, 0, primoffs.size());
+                P_ph.setPage(start);
+                for (GA_Offset ptoff = start; ptoff < end; ++ptoff)
+                {
+                    offsets.append(ptoff);
+                    positions.append(UT_Vector3D(P_ph.get(ptoff)));
+                }
+            }
+            const int n = offsets.size();
+            if (n == 0)
+                continue;
 
-                if (!as_solid_angle)
-                    sum *= (0.25*M_1_PI); // Divide by 4pi (solid angle of full sphere)
-                if (negate)
-                    sum = -sum;
+            UT_BoundingBoxD box(positions[0], positions[0]);
+            for (int i = 1; i < n; ++i)
+                box.enlargeBounds(positions[i]);
+            UT_Vector3D scale;
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                const double size = box.sizeAxis(axis);
+                scale[axis] = (size > 0) ? 1023.0/size : 0.0;
+            }
+            order.setSizeNoInit(n);
+            for (int i = 0; i < n; ++i)
+            {
+                const UT_Vector3D p = (positions[i] - box.minvec())*scale;
+                const uint32 code =
+                    (sopExpandBits10(uint32(p[0])) << 2) |
+                    (sopExpandBits10(uint32(p[1])) << 1) |
+                     sopExpandBits10(uint32(p[2]));
+                order[i] = std::make_pair(code, i);
+            }
+            std::sort(order.begin(), order.end());
 
-                winding_number_attrib.set(ptoff, sum);
+            attrib_ph.setPage(offsets[0]);
+            for (int j = 0; j < n; ++j)
+            {
+                const int i = order[j].second;
+                attrib_ph.set(offsets[i], eval(positions[i]));
             }
         }
-    });
+    }, 10); // Large subscribe ratio, because expensive points are often clustered
 }
 
 static double
-queryFullAccuracy(
-    UT_Vector3 query_point,
-    const GEO_Detail* const mesh_geo,
-    const GA_PrimitiveGroup* const mesh_prim_group,
-    const GA_RWHandleF& winding_number_attrib,
+queryExact(
+    const UT_Vector3D &query_point,
+    const SOP_WindingNumberCache &sopcache,
+    const GEO_Detail *const mesh_geo,
     const bool as_solid_angle,
     const bool negate)
 {
-    // See comment below for why we create this GA_Offsetlist of mesh primitive offsets.
-    GA_OffsetList primoffs;
-    if (!mesh_prim_group && mesh_geo->getPrimitiveMap().isTrivialMap())
-    {
-        primoffs.setTrivial(GA_Offset(0), mesh_geo->getNumPrimitives());
-    }
-    else
+    double sum = sopcache.myExactSolidAngle.computeSolidAngle(query_point);
+    if (sopcache.myExactOtherPrims.size() > 0)
     {
-        GA_Offset start;
-        GA_Offset end;
-        for (GA_Iterator it(mesh_geo->getPrimitiveRange(mesh_prim_group)); it.fullBlockAdvance(start, end); )
-        {
-            primoffs.setTrivialRange(primoffs.size(), start, end - start);
-        }
+        // Spheres and NURBS/Bezier surfaces aren't in the SoA buffers.
+        double other_sum;
+        sopSumContributions3D(&other_sum, query_point, mesh_geo, sopcache.myExactOtherPrims, 0, sopcache.myExactOtherPrims.size());
+        sum += other_sum;
     }
-    double sum;
-    sopSumContributions3D(&sum, query_point, mesh_geo, primoffs, 0, primoffs.size());
+
     if (!as_solid_angle)
-        sum *= (0.25 * M_1_PI); // Divide by 4pi (solid angle of full sphere)
+        sum *= (0.25*M_1_PI); // Divide by 4pi (solid angle of full sphere)
     if (negate)
         sum = -sum;
 
     return sum;
 }
 
+static void
+sop3DFullAccuracy(
+    const GEO_Detail *const query_points,
+    const GA_SplittableRange &point_range,
+    const SOP_WindingNumberCache &sopcache,
+    const GEO_Detail *const mesh_geo,
+    const GA_RWHandleF &winding_number_attrib,
+    const bool as_solid_angle,
+    const bool negate)
+{
+    UT_AutoInterrupt boss("Computing Winding Numbers");
+
+    // NOTE: We can't use UTparallelReduce, because that would have
+    //       nondeterministic roundoff error due to floating-point
+    //       addition being non-associative.  UT_SolidAngleSoA and
+    //       sopSumContributions3D always split in the middle of their lists,
+    //       so the roundoff doesn't depend on threading or defragmentation.
+    sopEvaluatePages(query_points, point_range, winding_number_attrib, boss,
+        [&sopcache,mesh_geo,as_solid_angle,negate](const UT_Vector3D &query_point) -> float
+    {
+        return queryExact(query_point, sopcache, mesh_geo, as_solid_angle, negate);
+    });
+}
+
 static void
 sop2DFullAccuracy(
     const GEO_Detail *const query_points,
@@ -1436,42 +1829,32 @@ sop3DApproximate(
 {
     UT_AutoInterrupt boss("Computing Winding Numbers");
 
-    UTparallelFor(point_range, [query_points,&winding_number_attrib,&solid_angle_tree,as_solid_angle,negate,accuracy_scale,&boss](const GA_SplittableRange &r)
+    sopEvaluatePages(query_points, point_range, winding_number_attrib, boss,
+        [&solid_angle_tree,as_solid_angle,negate,accuracy_scale](const UT_Vector3D &query_point) -> float
     {
-        GA_Offset start;
-        GA_Offset end;
-        for (GA_Iterator it(r); it.blockAdvance(start, end); )
-        {
-            if (boss.wasInterrupted())
-                return;
+        double sum = solid_angle_tree.computeSolidAngleD(query_point, accuracy_scale);
 
-            for (GA_Offset ptoff = start; ptoff != end; ++ptoff)
-            {
-                const UT_Vector3 query_point = query_points->getPos3(ptoff);
-
-                double sum = solid_angle_tree.computeSolidAngle(query_point, accuracy_scale);
-
-                if (!as_solid_angle)
-                    sum *= (0.25*M_1_PI); // Divide by 4pi (solid angle of full sphere)
-                if (negate)
-                    sum = -sum;
+        if (!as_solid_angle)
+            sum *= (0.25*M_1_PI); // Divide by 4pi (solid angle of full sphere)
+        if (negate)
+            sum = -sum;
 
-                winding_number_attrib.set(ptoff, sum);
-            }
-        }
-    }, 10); // Large subscribe ratio, because expensive points are often clustered
+        return sum;
+    });
 }
 
 static double
 queryApproximate(
-    UT_Vector3 query_point,
+    const UT_Vector3D &query_point,
     const UT_SolidAngle<float, float>& solid_angle_tree,
     const double accuracy_scale,
     const GA_RWHandleF& winding_number_attrib,
     const bool as_solid_angle,
     const bool negate)
 {
-    double sum = solid_angle_tree.computeSolidAngle(query_point, accuracy_scale);
+    // Stay in double until the query is moved into each node's frame, so that
+    // recentred trees don't lose the low bits of far-from-origin queries.
+    double sum = solid_angle_tree.computeSolidAngleD(query_point, accuracy_scale);
 
     if (!as_solid_angle)
         sum *= (0.25 * M_1_PI); // Divide by 4pi (solid angle of full sphere)
@@ -1481,6 +1864,162 @@ queryApproximate(
     return sum;
 }
 
+static void
+sopGetPrimOffsets(
+    GA_OffsetList &primoffs,
+    const GEO_Detail *const mesh_geo,
+    const GA_PrimitiveGroup *const mesh_prim_group)
+{
+    primoffs.clear();
+    if (!mesh_prim_group && mesh_geo->getPrimitiveMap().isTrivialMap())
+    {
+        primoffs.setTrivial(GA_Offset(0), mesh_geo->getNumPrimitives());
+    }
+    else
+    {
+        GA_Offset start;
+        GA_Offset end;
+        for (GA_Iterator it(mesh_geo->getPrimitiveRange(mesh_prim_group)); it.fullBlockAdvance(start, end); )
+        {
+            primoffs.setTrivialRange(primoffs.size(), start, end - start);
+        }
+    }
+}
+
+static double
+queryFullAccuracy2D(
+    const UT_Vector2D &query_point,
+    const GEO_Detail* const mesh_geo,
+    const GA_OffsetList &primoffs,
+    const bool as_angle,
+    const bool negate,
+    const int axis0,
+    const int axis1)
+{
+    double sum;
+    sopSumContributions2D(&sum, query_point, mesh_geo, primoffs, 0, primoffs.size(), axis0, axis1);
+    if (!as_angle)
+        sum *= (0.5 * M_1_PI); // Divide by 2pi (angle of full circle)
+    if (negate)
+        sum = -sum;
+
+    return sum;
+}
+
+static double
+queryApproximate2D(
+    const UT_Vector2D &query_point,
+    const UT_SubtendedAngle<float, float>& subtended_angle_tree,
+    const double accuracy_scale,
+    const bool as_angle,
+    const bool negate)
+{
+    double sum = subtended_angle_tree.computeAngle(UT_Vector2(query_point), accuracy_scale);
+
+    if (!as_angle)
+        sum *= (0.5 * M_1_PI); // Divide by 2pi (angle of full circle)
+    if (negate)
+        sum = -sum;
+
+    return sum;
+}
+
+/// Contours the 2D winding number of the mesh projected onto the axis0-axis1
+/// plane, and outputs the isolines as polylines in that plane, positioned at
+/// the centre of the mesh along the remaining axis.
+static void
+sop2DIsoline(
+    const SOP_NodeVerb::CookParms &cookparms,
+    const SOP_WindingIsosurfaceParms &sopparms,
+    SOP_WindingNumberCache *sopcache,
+    GEO_Detail *const query_points,
+    const GEO_Detail *const mesh_geo,
+    const GA_PrimitiveGroup *const mesh_prim_group,
+    const UT_StringHolder &mesh_prim_group_string,
+    const bool full_accuracy,
+    const bool as_angle,
+    const bool negate,
+    const int axis0,
+    const int axis1)
+{
+    GA_OffsetList primoffs;
+    if (full_accuracy)
+    {
+        sopcache->clear();
+        sopGetPrimOffsets(primoffs, mesh_geo, mesh_prim_group);
+    }
+    else
+    {
+        sopcache->update2D(*mesh_geo, mesh_prim_group, mesh_prim_group_string, 2, axis0, axis1);
+    }
+
+    UT_BoundingBox meshBound;
+    mesh_geo->computeQuickBounds(meshBound);
+    const UT_Vector2D boundMin(meshBound.minvec()[axis0], meshBound.minvec()[axis1]);
+    const UT_Vector2D boundMax(meshBound.maxvec()[axis0], meshBound.maxvec()[axis1]);
+    const double resolution = sopparms.getResolution();
+    const double isovalue = sopparms.getIsovalue();
+    UT_Vector2D offset = UT_Vector2D(-boundMin.x() + 2 * resolution, -boundMin.y() + 2 * resolution);
+    UT_Vector2D bound = UT_Vector2D(boundMax.x() - boundMin.x() + 10 * resolution, boundMax.y() - boundMin.y() + 10 * resolution);
+
+    const UT_SubtendedAngle<float, float>& subtended_angle_tree = sopcache->mySubtendedAngleTree;
+    const double accuracy_scale = sopparms.getAccuracyScale();
+
+    Geometry::MarchingSquare marchingSquare;
+    marchingSquare.implicit = [&](double u, double v) -> double
+    {
+        if (u < boundMin.x() || u > boundMax.x() || v < boundMin.y() || v > boundMax.y())
+        {
+            // below the isovalue whatever its sign, so the outside of the bound is always outside the curve
+            return isovalue - 1;
+        }
+        const UT_Vector2D queryPoint(u, v);
+        if (full_accuracy)
+        {
+            return queryFullAccuracy2D(
+                queryPoint,
+                mesh_geo, primoffs,
+                as_angle, negate,
+                axis0, axis1
+            );
+        }
+        return queryApproximate2D(
+            queryPoint,
+            subtended_angle_tree, accuracy_scale,
+            as_angle, negate
+        );
+    };
+
+    std::vector<UT_Vector2D> seeds;
+    seeds.reserve(query_points->getNumPoints());
+    for (GA_Offset ptoff : query_points->getPointRange())
+    {
+        UT_Vector3D point = query_points->getPos3D(ptoff);
+        seeds.push_back(UT_Vector2D(point[axis0], point[axis1]));
+    }
+    marchingSquare.Build(seeds, resolution, isovalue, bound, offset);
+    auto& verts = marchingSquare.GetVertices();
+    auto& polylines = marchingSquare.GetPolylines();
+    query_points->deletePoints(query_points->getPointRange(), GA_Detail::GA_DESTROY_DEGENERATE_INCOMPATIBLE);
+
+    const int axis2 = 3 - axis0 - axis1;
+    const double depth = meshBound.centerAxis(axis2);
+    for (const auto& polyline : polylines)
+    {
+        auto prim = GU_PrimPoly::build(query_points, polyline.indices.size(), !polyline.closed);
+        for (int j = 0; j < polyline.indices.size(); ++j)
+        {
+            const UT_Vector2D& uv = verts[polyline.indices[j]];
+            UT_Vector3D pos;
+            pos[axis0] = uv.x();
+            pos[axis1] = uv.y();
+            pos[axis2] = depth;
+            query_points->setPos3(prim->getPointOffset(j), pos);
+        }
+    }
+    query_points->bumpAllDataIds();
+}
+
 static void
 sop2DApproximate(
     const GEO_Detail *const query_points,
@@ -1583,13 +2122,77 @@ void SOP_WindingNumberVerb::cook(const CookParms& cookparms) const
     //       whereas most use the right-handed convension.
     const bool negate = !sopparms.getNegate();
 
+    if (sopparms.getOutput() == Output::ATTRIB)
+    {
+        // Just evaluate the winding number at the query points.
+        const double accuracy_scale = sopparms.getAccuracyScale();
+        if (winding_number_type == Type::XYZ)
+        {
+            if (full_accuracy)
+            {
+                sopcache->updateExact3D(*mesh_geo, mesh_prim_group, mesh_prim_group_string);
+                sop3DFullAccuracy(
+                    query_points, point_range,
+                    *sopcache, mesh_geo,
+                    winding_number_attrib,
+                    as_solid_angle, negate);
+            }
+            else
+            {
+                sopcache->update3D(*mesh_geo, mesh_prim_group, mesh_prim_group_string, 2, sopparms.getRecentre());
+                sop3DApproximate(
+                    query_points, point_range,
+                    sopcache->mySolidAngleTree, accuracy_scale,
+                    winding_number_attrib,
+                    as_solid_angle, negate);
+            }
+        }
+        else
+        {
+            const int axis0 = (winding_number_type == Type::XY) ? 0 : ((winding_number_type == Type::YZ) ? 1 : 2);
+            const int axis1 = (winding_number_type == Type::XY) ? 1 : ((winding_number_type == Type::YZ) ? 2 : 0);
+            if (full_accuracy)
+            {
+                sopcache->clear();
+                sop2DFullAccuracy(
+                    query_points, point_range,
+                    mesh_geo, mesh_prim_group,
+                    winding_number_attrib,
+                    as_solid_angle, negate,
+                    axis0, axis1);
+            }
+            else
+            {
+                sopcache->update2D(*mesh_geo, mesh_prim_group, mesh_prim_group_string, 2, axis0, axis1);
+                sop2DApproximate(
+                    query_points, point_range,
+                    sopcache->mySubtendedAngleTree, accuracy_scale,
+                    winding_number_attrib,
+                    as_solid_angle, negate,
+                    axis0, axis1);
+            }
+        }
+        winding_number_attrib.bumpDataId();
+        return;
+    }
+
+    if (winding_number_type != Type::XYZ)
+    {
+        const int axis0 = (winding_number_type == Type::XY) ? 0 : ((winding_number_type == Type::YZ) ? 1 : 2);
+        const int axis1 = (winding_number_type == Type::XY) ? 1 : ((winding_number_type == Type::YZ) ? 2 : 0);
+        sop2DIsoline(cookparms, sopparms, sopcache, query_points,
+            mesh_geo, mesh_prim_group, mesh_prim_group_string,
+            full_accuracy, as_solid_angle, negate, axis0, axis1);
+        return;
+    }
+
     if (full_accuracy)
     {
-        sopcache->clear();
+        sopcache->updateExact3D(*mesh_geo, mesh_prim_group, mesh_prim_group_string);
     }
     else
     {
-        sopcache->update3D(*mesh_geo, mesh_prim_group, mesh_prim_group_string, 2);
+        sopcache->update3D(*mesh_geo, mesh_prim_group, mesh_prim_group_string, 2, sopparms.getRecentre());
     }
     Geometry::MarchingCube marchingCube;
     int numSeeds = query_points->getNumPoints();
@@ -1606,10 +2209,9 @@ void SOP_WindingNumberVerb::cook(const CookParms& cookparms) const
         if (full_accuracy)
         {
             UT_Vector3D queryPoint = UT_Vector3D(x, y, z);
-            return queryFullAccuracy(
+            return queryExact(
                 queryPoint,
-                mesh_geo, mesh_prim_group,
-                winding_number_attrib,
+                *sopcache, mesh_geo,
                 as_solid_angle, negate
             );
         }
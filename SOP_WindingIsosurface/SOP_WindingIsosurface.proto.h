@@ -30,6 +30,11 @@ namespace SOP_WindingIsosurfaceEnums
         YZ,
         ZX
     };
+    enum class Output
+    {
+        SURFACE = 0,
+        ATTRIB
+    };
 }
 
 
@@ -52,6 +57,8 @@ public:
         myIsovalue = 0.5;
         myBound = UT_Vector3D(65535,65535,65535);
         myFieldOffset = UT_Vector3D(-32767,-32767,-32767);
+        myRecentre = false;
+        myOutput = 0;
 
     }
 
@@ -73,6 +80,8 @@ public:
         if (myIsovalue != src.myIsovalue) return false;
         if (myBound != src.myBound) return false;
         if (myFieldOffset != src.myFieldOffset) return false;
+        if (myRecentre != src.myRecentre) return false;
+        if (myOutput != src.myOutput) return false;
 
         return true;
     }
@@ -122,6 +131,12 @@ public:
         myFieldOffset = UT_Vector3D(-32767,-32767,-32767);
         if (true)
             graph->evalOpParm(myFieldOffset, nodeidx, "fieldOffset", time, 0);
+        myRecentre = false;
+        if (true && ( (true&&!(((getFullAccuracy()==1)))) ))
+            graph->evalOpParm(myRecentre, nodeidx, "recentre", time, 0);
+        myOutput = 0;
+        if (true)
+            graph->evalOpParm(myOutput, nodeidx, "output", time, 0);
 
     }
 
@@ -184,6 +199,12 @@ public:
             case 11:
                 coerceValue(value, myFieldOffset);
                 break;
+            case 12:
+                coerceValue(value, myRecentre);
+                break;
+            case 13:
+                coerceValue(value, myOutput);
+                break;
 
         }
     }
@@ -258,6 +279,12 @@ public:
             case 11:
                 coerceValue(myFieldOffset, ( ( value ) ));
                 break;
+            case 12:
+                coerceValue(myRecentre, ( ( value ) ));
+                break;
+            case 13:
+                coerceValue(myOutput, clampMinValue(0,  clampMaxValue(1,  value ) ));
+                break;
 
         }
     }
@@ -288,7 +315,7 @@ public:
     exint getNestNumParms(TempIndex idx) const override
     {
         if (idx.size() == 0)
-            return 12;
+            return 14;
         switch (idx[0])
         {
 
@@ -327,6 +354,10 @@ public:
                 return "bound";
             case 11:
                 return "fieldOffset";
+            case 12:
+                return "recentre";
+            case 13:
+                return "output";
 
         }
         return 0;
@@ -362,6 +393,10 @@ public:
                 return PARM_VECTOR3;
             case 11:
                 return PARM_VECTOR3;
+            case 12:
+                return PARM_INTEGER;
+            case 13:
+                return PARM_INTEGER;
 
         }
         return PARM_UNSUPPORTED;
@@ -488,6 +523,8 @@ public:
         saveData(os, myIsovalue);
         saveData(os, myBound);
         saveData(os, myFieldOffset);
+        saveData(os, myRecentre);
+        saveData(os, myOutput);
 
     }
 
@@ -512,6 +549,8 @@ public:
         loadData(is, myIsovalue);
         loadData(is, myBound);
         loadData(is, myFieldOffset);
+        loadData(is, myRecentre);
+        loadData(is, myOutput);
 
         return true;
     }
@@ -636,6 +675,26 @@ public:
         OP_Utils::evalOpParm(result, thissop, "fieldOffset", cookparms.getCookTime(), 0);
         return result;
     }
+    bool getRecentre() const { return myRecentre; }
+    void setRecentre(bool val) { myRecentre = val; }
+    bool opRecentre(const SOP_NodeVerb::CookParms &cookparms) const
+    { 
+        SOP_Node *thissop = cookparms.getNode();
+        if (!thissop) return getRecentre();
+        bool result;
+        OP_Utils::evalOpParm(result, thissop, "recentre", cookparms.getCookTime(), 0);
+        return result;
+    }
+    Output getOutput() const { return Output(myOutput); }
+    void setOutput(Output val) { myOutput = int64(val); }
+    Output opOutput(const SOP_NodeVerb::CookParms &cookparms) const
+    { 
+        SOP_Node *thissop = cookparms.getNode();
+        if (!thissop) return getOutput();
+        int64 result;
+        OP_Utils::evalOpParm(result, thissop, "output", cookparms.getCookTime(), 0);
+        return Output(result);
+    }
 
 private:
     UT_StringHolder myQueryPoints;
@@ -650,5 +709,7 @@ private:
     fpreal64 myIsovalue;
     UT_Vector3D myBound;
     UT_Vector3D myFieldOffset;
+    bool myRecentre;
+    int64 myOutput;
 
 };
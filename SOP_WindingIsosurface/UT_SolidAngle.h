@@ -33,6 +33,7 @@
 
 #include "UT_BVH.h"
 
+#include <UT/UT_Array.h>
 #include <UT/UT_UniquePtr.h>
 #include <UT/UT_Vector3.h>
 #include <SYS/SYS_Math.h>
@@ -216,19 +217,29 @@ public:
         const int *const triangle_points,
         const int npoints,
         const UT_Vector3T<S> *const positions,
-        const int order = 2)
+        const int order = 2,
+        const bool recentre = false)
         : UT_SolidAngle()
-    { init(ntriangles, triangle_points, npoints, positions, order); }
+    { init(ntriangles, triangle_points, npoints, positions, order, recentre); }
 
     /// Initialize the tree and data.
     /// NOTE: It is safe to call init on a UT_SolidAngle that has had init
     ///       called on it before, to re-initialize it.
+    ///
+    /// If recentre is true, the centre of mass of every node is kept in
+    /// double precision, and the box data of its children is stored relative
+    /// to it.  Queries are moved into each node's frame, and triangles are
+    /// made relative to the query, in double precision before being rounded
+    /// to T, and child contributions are summed with compensation.  This
+    /// keeps meshes accurate both far from the origin and when their own
+    /// extent is large, without needing a larger accuracy_scale.
     void init(
         const int ntriangles,
         const int *const triangle_points,
         const int npoints,
         const UT_Vector3T<S> *const positions,
-        const int order = 2);
+        const int order = 2,
+        const bool recentre = false);
 
     /// Frees myTree and myData, and clears the rest.
     void clear();
@@ -241,6 +252,15 @@ public:
     /// accuracy_scale is the value of (maxP/q) beyond which the approximation of the box will be used.
     T computeSolidAngle(const UT_Vector3T<T> &query_point, const T accuracy_scale = T(2.0)) const;
 
+    /// Same as computeSolidAngle, but the query point is given in double
+    /// precision, so that it can be made relative to each node before
+    /// it's rounded.  Use this for trees initialized with recentre true.
+    T computeSolidAngleD(const UT_Vector3D &query_point, const T accuracy_scale = T(2.0)) const;
+
+    /// Returns true if init was called with recentre true
+    bool isRecentred() const
+    { return myNodeCentres != nullptr; }
+
 private:
     struct BoxData;
 
@@ -253,6 +273,10 @@ private:
     const int *myTrianglePoints;
     int myNPoints;
     const UT_Vector3T<S> *myPositions;
+
+    /// Only allocated when recentred: the centre of mass of every node, which
+    /// the child centres in its BoxData are relative to.
+    UT_UniquePtr<UT_Vector3D[]> myNodeCentres;
 };
 
 template<typename T>
@@ -346,5 +370,57 @@ private:
     const UT_Vector2T<S> *myPositions;
 };
 
+/// Structure-of-arrays copy of a mesh's triangles and quads, for computing
+/// the exact signed solid angle of the mesh, i.e. the sum of
+/// UTsignedSolidAngleTri over the triangles and UTsignedSolidAngleQuad over
+/// the quads, with no tree approximation.
+///
+/// The elements are stored per coordinate, padded with degenerate elements
+/// to a multiple of LANES, and evaluated LANES at a time with branch-free
+/// code, (including atan2), so that the compiler can keep each block in
+/// vector registers.  The sum is always split in the same places, so the
+/// result doesn't depend on the number of threads.
+template<typename T>
+class UT_SolidAngleSoA
+{
+public:
+    static constexpr int LANES = 8;
+
+    UT_SolidAngleSoA();
+    ~UT_SolidAngleSoA();
+
+    /// Copies the triangles, (3 point indices each), and quads, (4 point
+    /// indices each, evaluated as bilinear patches), out of positions.
+    /// NOTE: positions is not referenced after this returns.
+    void init(
+        const int ntriangles,
+        const int *const triangle_points,
+        const int nquads,
+        const int *const quad_points,
+        const UT_Vector3T<T> *const positions);
+
+    /// Frees the arrays.
+    void clear();
+
+    /// Returns true if this is clear
+    bool isClear() const
+    { return myNTriangles == 0 && myNQuads == 0; }
+
+    /// Returns the exact signed solid angle of all of the triangles and
+    /// quads from the specified query_point.
+    T computeSolidAngle(const UT_Vector3T<T> &query_point) const;
+
+private:
+    T sumTriangleBlocks(const UT_Vector3T<T> &query_point, const exint start, const exint end) const;
+    T sumQuadBlocks(const UT_Vector3T<T> &query_point, const exint start, const exint end) const;
+
+    int myNTriangles;
+    int myNQuads;
+
+    /// x, y, z of the first point, then the second point, etc.
+    UT_Array<T> myTriangleCoords[9];
+    UT_Array<T> myQuadCoords[12];
+};
+
 } // End HDK_Sample namespace
 #endif